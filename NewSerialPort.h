@@ -27,13 +27,6 @@
 /** NewSerialPort version YYYYMMDD */
 #define SERIAL_PORT_VERSION 20120106
 //------------------------------------------------------------------------------
-/**
- * Set ALLOW_LARGE_BUFFERS to zero to limit buffer sizes to 254 bytes.
- * ALLOW_LARGE_BUFFERS controls whether uint16_t or uint8_t will be
- * used for buffer indices.
- */
-#define ALLOW_LARGE_BUFFERS 1
-//------------------------------------------------------------------------------
 /**
  * Set USE_WRITE_OVERRIDES to zero to use the Arduino Print version
  * of write(const char*) and write(const uint8_t*, size_t).  This will
@@ -41,26 +34,13 @@
  */
 #define USE_WRITE_OVERRIDES 1
 //------------------------------------------------------------------------------
-/**
- * Set BUFFERED_RX zero to save flash and RAM if no RX buffering is used.
- * RxBufSize must be zero in all NewSerialPort constructors if
- * BUFFERED_RX is zero.
- */
-#define BUFFERED_RX 1
-//------------------------------------------------------------------------------
-/**
- * Set BUFFERED_TX zero to save flash and RAM if no TX buffering is used.
- * TxBufSize must be zero in all NewSerialPort constructors if
- * BUFFERED_TX is zero.
- */
-#define BUFFERED_TX 1
-//------------------------------------------------------------------------------
 /**
  * Set ENABLE_RX_ERROR_CHECKING zero to disable RX error checking.
  */
 #define ENABLE_RX_ERROR_CHECKING 1
 //------------------------------------------------------------------------------
 // Define symbols to allocate 64 byte ring buffers with capacity for 63 bytes.
+// The port's ISRs must also be defined, see SERIAL_PORT_ISRS().
 /** Define NewSerial with buffering like Arduino 1.0. */
 #define USE_NEW_SERIAL NewSerialPort<0, 63, 63> NewSerial
 /** Define NewSerial1 with buffering like Arduino 1.0. */
@@ -219,57 +199,262 @@ static const UsartRegister usart[] = {
 };
 //------------------------------------------------------------------------------
 /**
- * \class SerialRingBuffer
+ * \class RingIndex
+ * \brief smallest index type for a ring buffer
+ */
+template<bool Large> struct RingIndex {typedef uint8_t type;};
+template<> struct RingIndex<true> {typedef uint16_t type;};
+//------------------------------------------------------------------------------
+/**
+ * \class RingBuffer
  * \brief ring buffer for RX and TX data
+ *
+ * Size is the number of bytes of storage, the capacity is Size - 1.
+ * Indices are one byte if Size is 256 or less and wrap with a mask if
+ * Size is a power of two.
+ *
+ * The producer owns head_ and the consumer owns tail_.  Use isrGet()
+ * and isrPut() from the side running in an ISR; they read the other
+ * index without disabling interrupts, so the non-ISR side stores its
+ * index (and the high-water mark) with interrupts off when it's two
+ * bytes and an ISR can't see half of an update.  The non-ISR side
+ * also keeps the high-water mark (the producer after a put, the
+ * consumer before a get) so the ISRs don't pay for it.
  */
-class SerialRingBuffer {
+template<size_t Size>
+class RingBuffer {
  public:
   /** Define type for buffer indices */
-#if ALLOW_LARGE_BUFFERS
-  typedef uint16_t buf_size_t;
-#else  // ALLOW_LARGE_BUFFERS
-  typedef uint8_t buf_size_t;
-#endif  // ALLOW_LARGE_BUFFERS
-  int available();
+  typedef typename RingIndex<(Size > 256)>::type buf_size_t;
+  /** \return the number of bytes in the ring buffer */
+  int available() {return count(load(head_), load(tail_));}
   /** \return true if the ring buffer is empty else false */
-  bool empty() {return head_ == tail_;}
-  void flush();
-  bool get(uint8_t* b);
-  buf_size_t get(uint8_t* b, buf_size_t n);
-  void init(uint8_t* b, buf_size_t s);
-  int peek();
-  bool put(uint8_t b);
-  buf_size_t put(const uint8_t* b, buf_size_t n);
-  buf_size_t put_P(PGM_P b, buf_size_t n);
+  bool empty() {return load(head_) == load(tail_);}
+  /** Reset the high-water mark. */
+  void clearHighWater() {
+    uint8_t s = SREG;
+    cli();
+    hwm_ = 0;
+    SREG = s;
+  }
+  /** Discard all data in the ring buffer. */
+  void flush() {
+    uint8_t s = SREG;
+    cli();
+    taken_ += count(head_, tail_);
+    head_ = tail_ = 0;
+    SREG = s;
+  }
+  /** get the next byte
+   * \param[in] b location for the returned byte
+   * \return true if a byte was returned or false if the ring buffer is empty
+   */
+  bool get(uint8_t* b) {
+    buf_size_t h = load(head_);
+    buf_size_t t = tail_;
+    if (h == t) return false;
+    mark(h, t);
+    *b = buf_[t];
+    take(next(t), 1);
+    return true;
+  }
+  /**
+   * Get the maximum number of contiguous bytes from the ring buffer
+   * with one call to memcpy.
+   *
+   * \param[in] b pointer to data
+   * \param[in] n number of bytes to transfer from the ring buffer
+   * \return number of bytes transferred
+   */
+  size_t get(uint8_t* b, size_t n) {
+    buf_size_t h = load(head_);
+    buf_size_t t = tail_;
+    size_t nr;
+    if (h < t) {
+      nr = Size - t;
+    } else if (t < h) {
+      nr = h - t;
+    } else {
+      return 0;
+    }
+    mark(h, t);
+    if (nr > n) nr = n;
+    memcpy(b, &buf_[t], nr);
+    take(wrap(t + nr), nr);
+    return nr;
+  }
+  /** get() for the consumer's ISR */
+  bool isrGet(uint8_t* b) {
+    buf_size_t t = tail_;
+    if (head_ == t) return false;
+    *b = buf_[t];
+    tail_ = next(t);
+    return true;
+  }
+  /** \return the most bytes the ring has held */
+  buf_size_t highWater() {return load(hwm_);}
+  /**
+   * \return bytes put in the ring since boot (for a ring get() reads)
+   * from any context
+   */
+  uint32_t position() {
+    uint8_t s = SREG;
+    cli();
+    uint32_t r = taken_ + count(head_, tail_);
+    SREG = s;
+    return r;
+  }
+  /** put() for the producer's ISR */
+  bool isrPut(uint8_t b) {
+    buf_size_t h = head_;
+    // OK to store here even if ring is full
+    buf_[h] = b;
+    h = next(h);
+    buf_size_t t = tail_;
+    if (h == t) return false;
+    head_ = h;
+    return true;
+  }
+  /** peek at the next byte in the ring buffer
+   * \return the next byte that would ber read or -1 if the ring buffer is empty
+   */
+  int peek() {return empty() ? -1 : buf_[tail_];}
+  /** put a byte into the ring buffer
+   * \param[in] b the byte
+   * \return true if byte was transferred or false if the ring buffer is full
+   */
+  bool put(uint8_t b) {
+    buf_size_t h = head_;
+    // OK to store here even if ring is full
+    buf_[h] = b;
+    h = next(h);
+    buf_size_t t = load(tail_);
+    if (h == t) return false;
+    store(head_, h);
+    mark(h, t);
+    return true;
+  }
+  /**
+   * Put the maximum number of contiguous bytes into the ring buffer
+   * with one call to memcpy.
+   *
+   * \param[in] b pointer to data
+   * \param[in] n number of bytes to transfer to the ring buffer
+   * \return number of bytes transferred
+   */
+  size_t put(const uint8_t* b, size_t n) {
+    buf_size_t t = load(tail_);
+    size_t space = room(t);
+    if (n > space) n = space;
+    buf_size_t h = head_;
+    memcpy(&buf_[h], b, n);
+    h = wrap(h + n);
+    store(head_, h);
+    mark(h, t);
+    return n;
+  }
+  /**
+   * Put the maximum number of contiguous bytes from flash into the ring
+   * buffer with one call to memcpy_P.
+   *
+   * \param[in] b pointer to data
+   * \param[in] n number of bytes to transfer to the ring buffer
+   * \return number of bytes transferred
+   */
+  size_t put_P(PGM_P b, size_t n) {
+    buf_size_t t = load(tail_);
+    size_t space = room(t);
+    if (n > space) n = space;
+    buf_size_t h = head_;
+    memcpy_P(&buf_[h], b, n);
+    h = wrap(h + n);
+    store(head_, h);
+    mark(h, t);
+    return n;
+  }
+
  private:
-  uint8_t* buf_;              /**< Pointer to start of buffer. */
+  static const bool pow2_ = (Size & (Size - 1)) == 0;
+  // bytes between h and t
+  static int count(buf_size_t h, buf_size_t t) {
+    if (pow2_) return (h - t) & (Size - 1);
+    return h < t ? Size - t + h : h - t;
+  }
+  // read the other side's index
+  static buf_size_t load(const volatile buf_size_t& v) {
+    if (sizeof(buf_size_t) == 1) return v;
+    uint8_t s = SREG;
+    cli();
+    buf_size_t r = v;
+    SREG = s;
+    return r;
+  }
+  // set our index (or the high-water mark) where an ISR reads it
+  static void store(volatile buf_size_t& v, buf_size_t x) {
+    if (sizeof(buf_size_t) == 1) {
+      v = x;
+      return;
+    }
+    uint8_t s = SREG;
+    cli();
+    v = x;
+    SREG = s;
+  }
+  // move tail_ on past n bytes; taken_ changes with it for position()
+  void take(buf_size_t t, size_t n) {
+    uint8_t s = SREG;
+    cli();
+    tail_ = t;
+    taken_ += n;
+    SREG = s;
+  }
+  // update the high-water mark for h and t
+  void mark(buf_size_t h, buf_size_t t) {
+    buf_size_t n = count(h, t);
+    if (n > hwm_) store(hwm_, n);
+  }
+  static buf_size_t next(buf_size_t i) {
+    if (pow2_) return (i + 1) & (Size - 1);
+    return i + 1U < Size ? i + 1 : 0;
+  }
+  // contiguous space after head_
+  size_t room(buf_size_t t) {
+    buf_size_t h = head_;
+    if (h < t) return t - h - 1;
+    return Size - h - (t == 0 ? 1 : 0);
+  }
+  // an index advanced by at most Size
+  static buf_size_t wrap(size_t i) {return i < Size ? i : 0;}
+  uint8_t buf_[Size];         /**< Ring storage. */
   volatile buf_size_t head_;  /**< Index to next empty location. */
   volatile buf_size_t tail_;  /**< Index to last entry if head_ != tail_. */
-  buf_size_t size_;           /**< Size of the buffer. Capacity is size -1. */
+  volatile buf_size_t hwm_;   /**< Most bytes held. */
+  uint32_t taken_;            /**< Bytes get() has taken out. */
 };
 //------------------------------------------------------------------------------
-/** RX ring buffers */
-extern SerialRingBuffer rxRingBuf[];
-/** TX ring buffers */
-extern SerialRingBuffer txRingBuf[];
-/** RX error bits */
-extern uint8_t rxErrorBits[];
-//------------------------------------------------------------------------------
-/** Cause error message for bad port number
- * \return Never returns since it is never called
- */
-uint8_t badPortNumber(void)
-  __attribute__((error("Bad port number")));
-/** Cause error message for bad port number
- * \return Never returns since it is never called
- */
-uint8_t badRxBufSize(void)
-  __attribute__((error("RX buffer size too large")));
-/** Cause error message for bad port number
- * \return Never returns since it is never called
+/**
+ * \class RingBuffer<1>
+ * \brief no storage for an unbuffered direction
  */
-uint8_t badTxBufSize(void)
-  __attribute__((error("TX buffer size too large")));
+template<>
+class RingBuffer<1> {
+ public:
+  typedef uint8_t buf_size_t;
+  int available() {return 0;}
+  bool empty() {return true;}
+  void clearHighWater() {}
+  void flush() {}
+  bool get(uint8_t* b) {return false;}
+  size_t get(uint8_t* b, size_t n) {return 0;}
+  buf_size_t highWater() {return 0;}
+  uint32_t position() {return 0;}
+  bool isrGet(uint8_t* b) {return false;}
+  bool isrPut(uint8_t b) {return false;}
+  int peek() {return -1;}
+  bool put(uint8_t b) {return false;}
+  size_t put(const uint8_t* b, size_t n) {return 0;}
+  size_t put_P(PGM_P b, size_t n) {return 0;}
+};
 //------------------------------------------------------------------------------
 /**
  * \class NewSerialPort
@@ -277,16 +462,74 @@ uint8_t badTxBufSize(void)
  */
 template<uint8_t PortNumber, size_t RxBufSize, size_t TxBufSize>
 class NewSerialPort : public Stream {
+  static_assert(PortNumber < SERIAL_PORT_COUNT, "Bad port number");
+
  public:
   //----------------------------------------------------------------------------
-  NewSerialPort() {
-    if (PortNumber >= SERIAL_PORT_COUNT) badPortNumber();
-    if (sizeof(SerialRingBuffer::buf_size_t) == 1) {
-      if (RxBufSize >254) badRxBufSize();
-      if (TxBufSize >254) badTxBufSize();
+  /**
+   * RX ISR body.  The registers and the ring are at constant addresses
+   * and a power of two ring wraps with a mask.
+   *
+   * \return the error bits for this byte (zero if none)
+   */
+  static uint8_t rxIsr() {
+    uint8_t e = 0;
+    uint8_t b = rxRead(&e);
+    return rxStore(b, e);
+  }
+  //----------------------------------------------------------------------------
+  /**
+   * First half of rxIsr(): read the status and data registers.  Reading
+   * UDR clears RXC so an ISR may enable interrupts after this.
+   *
+   * \param[out] e RX error bits
+   * \return the received byte
+   */
+  static uint8_t rxRead(uint8_t* e) {
+  #if ENABLE_RX_ERROR_CHECKING
+    *e = *usart[PortNumber].ucsra & SP_UCSRA_ERROR_MASK;
+  #endif  // ENABLE_RX_ERROR_CHECKING
+    return *usart[PortNumber].udr;
+  }
+  //----------------------------------------------------------------------------
+  /**
+   * Second half of rxIsr(): store a byte from rxRead() in the ring.
+   *
+   * \param[in] b the byte
+   * \param[in] e RX error bits
+   * \return e plus SP_RX_BUF_OVERRUN if the ring was full
+   */
+  static uint8_t rxStore(uint8_t b, uint8_t e) {
+    if (!rxRing_.isrPut(b)) {
+      e |= SP_RX_BUF_OVERRUN;
+  #if ENABLE_RX_ERROR_CHECKING
+      rxLost_++;
+  #endif  // ENABLE_RX_ERROR_CHECKING
+    }
+  #if ENABLE_RX_ERROR_CHECKING
+    // skip the read-modify-write in the common case
+    if (e) rxError_ |= e;
+  #endif  // ENABLE_RX_ERROR_CHECKING
+    return e;
+  }
+  //----------------------------------------------------------------------------
+  /**
+   * Get the next byte to transmit from the TX ISR.
+   *
+   * \param[out] b the byte
+   * \return true if there was one
+   */
+  static bool txGet(uint8_t* b) {return txRing_.isrGet(b);}
+  //----------------------------------------------------------------------------
+  /** TX (data register empty) ISR body. */
+  static void txIsr() {
+    uint8_t b;
+    if (txRing_.isrGet(&b)) {
+      *usart[PortNumber].udr = b;
+    } else {
+      // no data - disable interrupts
+      *usart[PortNumber].ucsrb &= ~M_UDRIE;
     }
-    if (RxBufSize) rxRingBuf[PortNumber].init(rxBuffer_, sizeof(rxBuffer_));
-    if (TxBufSize) txRingBuf[PortNumber].init(txBuffer_, sizeof(txBuffer_));
   }
   //----------------------------------------------------------------------------
   /**
@@ -297,10 +540,17 @@ class NewSerialPort : public Stream {
     if (!RxBufSize) {
       return *usart[PortNumber].ucsra & M_RXC ? 1 : 0;
     } else {
-      return rxRingBuf[PortNumber].available();
+      return rxRing_.available();
     }
   }
   //----------------------------------------------------------------------------
+  /**
+   * \return The number of bytes that can be written without waiting.
+   */
+  int availableForWrite(void) {
+    return TxBufSize ? TxBufSize - txRing_.available() : 0;
+  }
+  //----------------------------------------------------------------------------
   /**
    * Sets the data rate in bits per second (baud) for serial data transmission.
    *
@@ -331,27 +581,47 @@ class NewSerialPort : public Stream {
    * SP_8_BIT_CHAR - use 8-bit characters
    */
   void begin(uint32_t baud, uint8_t options = SP_8_BIT_CHAR) {
-    uint16_t baud_setting;
-
-    // disable USART interrupts.  Set UCSRB to reset values.
-    *usart[PortNumber].ucsrb = 0;
-
-    // set option bits
-    *usart[PortNumber].ucsrc = options & SP_OPT_MASK;
-
     if (F_CPU == 16000000UL && baud == 57600) {
       // hardcoded exception for compatibility with the bootloader shipped
       // with the Duemilanove and previous boards and the firmware on the 8U2
       // on the Uno and Mega 2560.
-      *usart[PortNumber].ucsra = 0;
-      baud_setting = (F_CPU / 8 / baud - 1) / 2;
+      beginUbrr((F_CPU / 8 / baud - 1) / 2, false, options);
+      return;
+    }
+    // rounded divisors with and without U2X, use the closer one
+    uint16_t ubrr16 = (F_CPU + 8 * baud) / (16 * baud) - 1;
+    uint16_t ubrr8 = (F_CPU + 4 * baud) / (8 * baud) - 1;
+    uint32_t err16 = baudError(baud, 16 * (ubrr16 + 1UL));
+    uint32_t err8 = baudError(baud, 8 * (ubrr8 + 1UL));
+    if (err16 <= err8) {
+      beginUbrr(ubrr16, false, options);
     } else {
-      *usart[PortNumber].ucsra = M_U2X;
-      baud_setting = (F_CPU / 4 / baud - 1) / 2;
+      beginUbrr(ubrr8, true, options);
     }
+  }
+  //----------------------------------------------------------------------------
+  /**
+   * Set baud rate using a precomputed divisor.
+   *
+   * \param[in] ubrr USART Baud Rate Register value.
+   *
+   * \param[in] u2x Double the USART transmission speed.
+   *
+   * \param[in] options Character size, parity and stop bits (see begin()).
+   */
+  void beginUbrr(uint16_t ubrr, bool u2x,
+                 uint8_t options = SP_8_BIT_CHAR) {
+    // disable USART interrupts.  Set UCSRB to reset values.
+    *usart[PortNumber].ucsrb = 0;
+
+    // set option bits
+    *usart[PortNumber].ucsrc = options & SP_OPT_MASK;
+
+    *usart[PortNumber].ucsra = u2x ? M_U2X : 0;
+
     // assign the baud_setting, a.k.a. ubbr (USART Baud Rate Register)
-    *usart[PortNumber].ubrrh = baud_setting >> 8;
-    *usart[PortNumber].ubrrl = baud_setting;
+    *usart[PortNumber].ubrrh = ubrr >> 8;
+    *usart[PortNumber].ubrrl = ubrr;
 
     // enable RX and TX
     uint8_t bits = M_TXEN | M_RXEN;
@@ -363,11 +633,31 @@ class NewSerialPort : public Stream {
   //----------------------------------------------------------------------------
   #if ENABLE_RX_ERROR_CHECKING
   /** clear RX error bits */
-  void clearRxError() {rxErrorBits[PortNumber] = 0;}
+  void clearRxError() {rxError_ = 0;}
   /** \return RX error bits */
-  uint8_t getRxError() {return rxErrorBits[PortNumber];}
+  uint8_t getRxError() {return rxError_;}
+  /** \return number of RX bytes dropped because the ring buffer was full */
+  uint32_t getRxLost() {
+    uint8_t s = SREG;
+    cli();
+    uint32_t n = rxLost_;
+    SREG = s;
+    return n;
+  }
   #endif  // ENABLE_RX_ERROR_CHECKING
   //----------------------------------------------------------------------------
+  /** Reset the RX and TX high-water marks. */
+  void clearHighWater() {
+    rxRing_.clearHighWater();
+    txRing_.clearHighWater();
+  }
+  /** \return the most bytes the RX ring has held */
+  size_t rxHighWater() {return rxRing_.highWater();}
+  /** \return bytes put in the RX ring since boot, from any context */
+  uint32_t rxPosition() {return rxRing_.position();}
+  /** \return the most bytes the TX ring has held */
+  size_t txHighWater() {return txRing_.highWater();}
+  //----------------------------------------------------------------------------
   /**
    * Disables serial communication, allowing the RX and TX pins to be used for
    * general input and output. To re-enable serial communication,
@@ -399,7 +689,7 @@ class NewSerialPort : public Stream {
    */
   void flushRx() {
     if (RxBufSize) {
-      rxRingBuf[PortNumber].flush();
+      rxRing_.flush();
     } else {
       uint8_t b;
       while (*usart[PortNumber].ucsra & M_RXC) b = *usart[PortNumber].udr;
@@ -411,7 +701,7 @@ class NewSerialPort : public Stream {
    */
   void flushTx() {
     if (TxBufSize) {
-      while (!txRingBuf[PortNumber].empty()) {}
+      while (!txRing_.empty()) {}
     }
   }
   //----------------------------------------------------------------------------
@@ -420,7 +710,7 @@ class NewSerialPort : public Stream {
    *  -1 if no data is available.  Peek() always return -1 for unbuffered RX.
    */
   int peek(void) {
-    return RxBufSize ? rxRingBuf[PortNumber].peek() : -1;
+    return RxBufSize ? rxRing_.peek() : -1;
   }
   //----------------------------------------------------------------------------
   /**
@@ -434,12 +724,12 @@ class NewSerialPort : public Stream {
     if (!RxBufSize) {
       uint8_t s = *usart[PortNumber].ucsra;
   #if ENABLE_RX_ERROR_CHECKING
-      rxErrorBits[PortNumber] |= s & SP_UCSRA_ERROR_MASK;
+      rxError_ |= s & SP_UCSRA_ERROR_MASK;
   #endif  // ENABLE_RX_ERROR_CHECKING
       return  s & M_RXC ? *usart[PortNumber].udr : -1;
     } else {
       uint8_t b;
-      return rxRingBuf[PortNumber].get(&b) ? b : -1;
+      return rxRing_.get(&b) ? b : -1;
     }
   }
   //----------------------------------------------------------------------------
@@ -456,10 +746,8 @@ class NewSerialPort : public Stream {
     uint8_t* limit = b + n;
     uint8_t* p = b;
     if (RxBufSize) {
-      while (p < limit && !rxRingBuf[PortNumber].empty()) {
-        size_t nr = limit - p;
-        if (sizeof(SerialRingBuffer::buf_size_t) == 1 && nr > 255) nr = 255;
-        p += rxRingBuf[PortNumber].get(p, nr);
+      while (p < limit && !rxRing_.empty()) {
+        p += rxRing_.get(p, limit - p);
       }
       return p - b;
     } else {
@@ -472,6 +760,40 @@ class NewSerialPort : public Stream {
     return p - b;
   }
   //----------------------------------------------------------------------------
+  /**
+   * Write as much as fits in the TX ring without waiting.
+   *
+   * \param[in] b bytes to be written
+   * \param[in] n number of bytes to write
+   * \return number of bytes written (zero if TX is unbuffered)
+   */
+  __attribute__((noinline))
+  size_t tryWrite(const uint8_t* b, size_t n) {
+    size_t w = 0;
+    size_t m;
+    while (w < n && (m = txRing_.put(b + w, n - w)) != 0) w += m;
+    // enable interrupts
+    if (w) *usart[PortNumber].ucsrb |= M_UDRIE;
+    return w;
+  }
+  //----------------------------------------------------------------------------
+  /**
+   * Write as much from flash as fits in the TX ring without waiting.
+   *
+   * \param[in] b bytes to be written
+   * \param[in] n number of bytes to write
+   * \return number of bytes written (zero if TX is unbuffered)
+   */
+  __attribute__((noinline))
+  size_t tryWrite_P(PGM_P b, size_t n) {
+    size_t w = 0;
+    size_t m;
+    while (w < n && (m = txRing_.put_P(b + w, n - w)) != 0) w += m;
+    // enable interrupts
+    if (w) *usart[PortNumber].ucsrb |= M_UDRIE;
+    return w;
+  }
+  //----------------------------------------------------------------------------
   /**
    * Write binary data to the serial port.
    *
@@ -489,7 +811,7 @@ class NewSerialPort : public Stream {
       *usart[PortNumber].udr = b;
     } else {
       // wait for TX ISR if buffer is full
-      while (!txRingBuf[PortNumber].put(b)) {}
+      while (!txRing_.put(b)) {}
       // enable interrupts
       *usart[PortNumber].ucsrb |= M_UDRIE;
     }
@@ -551,9 +873,7 @@ class NewSerialPort : public Stream {
     } else {
       size_t w = n;
       while (w) {
-        size_t nw = w;
-        if (sizeof(SerialRingBuffer::buf_size_t) == 1 && nw > 255) nw = 255;
-        size_t m = txRingBuf[PortNumber].put_P(b, nw);
+        size_t m = txRing_.put_P(b, w);
         // enable interrupts
         *usart[PortNumber].ucsrb |= M_UDRIE;
         w -= m;
@@ -623,9 +943,7 @@ class NewSerialPort : public Stream {
     } else {
       size_t w = n;
       while (w) {
-        size_t nw = w;
-        if (sizeof(SerialRingBuffer::buf_size_t) == 1 && nw > 255) nw = 255;
-        size_t m = txRingBuf[PortNumber].put(b, nw);
+        size_t m = txRing_.put(b, w);
         // enable interrupts
         *usart[PortNumber].ucsrb |= M_UDRIE;
         w -= m;
@@ -660,10 +978,58 @@ class NewSerialPort : public Stream {
   #endif  // USE_WRITE_OVERRIDES
   //----------------------------------------------------------------------------
  private:
-  // RX buffer with a capacity of RxBufSize.
-  uint8_t rxBuffer_[RxBufSize + 1];
-  // TX buffer with a capacity of TxBufSize
-  uint8_t txBuffer_[TxBufSize + 1];
+  // absolute difference between baud and F_CPU / clocksPerBit
+  static uint32_t baudError(uint32_t baud, uint32_t clocksPerBit) {
+    uint32_t actual = F_CPU / clocksPerBit;
+    return actual > baud ? actual - baud : baud - actual;
+  }
+  // RX ring with a capacity of RxBufSize.
+  static RingBuffer<RxBufSize + 1> rxRing_;
+  // TX ring with a capacity of TxBufSize
+  static RingBuffer<TxBufSize + 1> txRing_;
+  #if ENABLE_RX_ERROR_CHECKING
+  // RX error bits
+  static volatile uint8_t rxError_;
+  // RX bytes dropped because the ring buffer was full
+  static uint32_t rxLost_;
+  #endif  // ENABLE_RX_ERROR_CHECKING
 };
 //------------------------------------------------------------------------------
+// Storage is only allocated for ports that are declared.
+template<uint8_t PortNumber, size_t RxBufSize, size_t TxBufSize>
+RingBuffer<RxBufSize + 1>
+  NewSerialPort<PortNumber, RxBufSize, TxBufSize>::rxRing_;
+template<uint8_t PortNumber, size_t RxBufSize, size_t TxBufSize>
+RingBuffer<TxBufSize + 1>
+  NewSerialPort<PortNumber, RxBufSize, TxBufSize>::txRing_;
+#if ENABLE_RX_ERROR_CHECKING
+template<uint8_t PortNumber, size_t RxBufSize, size_t TxBufSize>
+volatile uint8_t NewSerialPort<PortNumber, RxBufSize, TxBufSize>::rxError_;
+template<uint8_t PortNumber, size_t RxBufSize, size_t TxBufSize>
+uint32_t NewSerialPort<PortNumber, RxBufSize, TxBufSize>::rxLost_;
+#endif  // ENABLE_RX_ERROR_CHECKING
+//------------------------------------------------------------------------------
+// ISR vectors by port number
+#if defined(USART0_RX_vect)
+#define SERIAL_RX0_vect USART0_RX_vect
+#define SERIAL_UDRE0_vect USART0_UDRE_vect
+#elif defined(USART_RX_vect)
+#define SERIAL_RX0_vect USART_RX_vect
+#define SERIAL_UDRE0_vect USART_UDRE_vect
+#endif  // USART0_RX_vect
+#define SERIAL_RX1_vect USART1_RX_vect
+#define SERIAL_UDRE1_vect USART1_UDRE_vect
+#define SERIAL_RX2_vect USART2_RX_vect
+#define SERIAL_UDRE2_vect USART2_UDRE_vect
+#define SERIAL_RX3_vect USART3_RX_vect
+#define SERIAL_UDRE3_vect USART3_UDRE_vect
+/**
+ * Define the RX and TX ISRs for a port, e.g. SERIAL_PORT_ISRS(1, NewSerial1).
+ * Only declared ports get ISRs; an application that wants its own
+ * builds them from rxIsr() (or rxRead() and rxStore()) and txIsr().
+ */
+#define SERIAL_PORT_ISRS(n, port)\
+  ISR(SERIAL_RX##n##_vect) {port.rxIsr();}\
+  ISR(SERIAL_UDRE##n##_vect) {port.txIsr();}
+//------------------------------------------------------------------------------
 #endif  // NewSerialPort_h
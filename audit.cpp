@@ -0,0 +1,112 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * Interrupt latency audit (-DISR_AUDIT)
+ *
+ * Each handler we own records its run time and how long it kept
+ * interrupts off. The capture RX interrupt can be held off by the
+ * longest blocked section of any other handler plus its own run for
+ * the previous byte; that has to stay under two character times or
+ * the USART overruns (DOR).
+ *
+ * The Timer0 (millis) handler is in the Arduino core and isn't
+ * timed, nor are cli() sections in the main line code.
+ */
+
+#if __has_include("local.h")
+#include "local.h"
+#endif
+
+#include "sdlogger.h"
+
+#include "audit.h"
+#include "eeprom.h"
+#include "serial.h"
+#include "sstrings.h"
+
+#ifdef ISR_AUDIT
+/* Cycles to tenths of a us (14745 cycles, 1 ms at 14.7456 MHz, is 10003) */
+#define AUDIT_TENTHS(c)	((((u_long)(c)) * 1000UL) / (F_CPU / 10000UL))
+
+/* Locals */
+static const char an_rx0[] PROGMEM = "rx0";
+static const char an_rx1[] PROGMEM = "rx1";
+static const char an_tx1[] PROGMEM = "tx1";
+static const char an_twi[] PROGMEM = "twi";
+static const char an_sched[] PROGMEM = "sched";
+static const char an_sqw[] PROGMEM = "sqw";
+static const char an_ee[] PROGMEM = "eeprom";
+static const char an_ab[] PROGMEM = "autobaud";
+
+/* Globals */
+struct audit audits[AUDIT_N];
+PGM_P const audit_names[AUDIT_N] PROGMEM = {
+	an_rx0, an_rx1, an_tx1, an_twi, an_sched, an_sqw, an_ee, an_ab
+};
+
+void
+audit_cmd(char *s)
+{
+	uint8_t i, worst;
+	uint16_t blocked, rx0max;
+	u_long t, t2;
+	struct audit a;
+
+	while (isblank(*s))
+		++s;
+	if (strcmp_P(s, PSTR("reset")) == 0) {
+		/* Leave the profiler's totals alone */
+		cli();
+		for (i = 0; i < AUDIT_N; ++i) {
+			audits[i].max = 0;
+			audits[i].blocked = 0;
+			audits[i].runs = 0;
+		}
+		sei();
+		return;
+	}
+	if (*s != '\0') {
+		serial_putstr(FV(msg_errmsg));
+		return;
+	}
+	SERIAL_PUTSTR("isr            runs      max  blocked\n");
+	worst = 0;
+	blocked = 0;
+	rx0max = 0;
+	for (i = 0; i < AUDIT_N; ++i) {
+		cli();
+		a = audits[i];
+		sei();
+		t = AUDIT_TENTHS(a.max);
+		t2 = AUDIT_TENTHS(a.blocked);
+		PRINTF("%-8S %10lu %4lu.%luus %4lu.%luus\n",
+		    (PGM_P)pgm_read_word(&audit_names[i]), a.runs,
+		    t / 10, t % 10, t2 / 10, t2 % 10);
+		if (i == AUDIT_RX0)
+			rx0max = a.max;
+		else if (a.blocked > blocked) {
+			blocked = a.blocked;
+			worst = i;
+		}
+	}
+
+	/* Worst case: another handler's blocked section and our own run */
+	t = AUDIT_TENTHS((u_long)blocked + rx0max);
+	PRINTF("rx0 worst latency %lu.%luus (%S)", t / 10, t % 10,
+	    (PGM_P)pgm_read_word(&audit_names[worst]));
+	if (eeprom.speed != 0) {
+		/* Two 10 bit characters */
+		t2 = 200000000UL / eeprom.speed;
+		PRINTF(", overrun at %lu.%luus", t2 / 10, t2 % 10);
+	}
+	serial_nl();
+}
+
+void
+audit_init(void)
+{
+	/* Timer1: normal mode, clk/1 */
+	TCCR1A = 0;
+	TCCR1B = _BV(CS10);
+}
+#endif
@@ -0,0 +1,95 @@
+/* @(#) $Id$ (XSE) */
+
+#ifndef _audit_h
+#define _audit_h
+
+/* Interrupt handlers that are timed */
+#define AUDIT_RX0	0		/* capture RX */
+#define AUDIT_RX1	1		/* console RX */
+#define AUDIT_TX1	2		/* console TX */
+#define AUDIT_TWI	3
+#define AUDIT_SCHED	4		/* Timer2 tick */
+#define AUDIT_SQW	5		/* RTC SQW (INT2) */
+#define AUDIT_EE	6		/* EEPROM ready */
+#define AUDIT_AB	7		/* auto-baud edges */
+#define AUDIT_N		8
+
+/* The profiler uses the audit hooks to account for interrupt time */
+#if defined(PROF) && !defined(ISR_AUDIT)
+#define ISR_AUDIT
+#endif
+
+#ifdef ISR_AUDIT
+struct audit {
+	uint16_t max;			/* longest run (cycles) */
+	uint16_t blocked;		/* longest with interrupts off (cycles) */
+	uint32_t runs;
+#ifdef PROF
+	u_long cycles;			/* total (wraps) */
+#endif
+};
+
+extern struct audit audits[AUDIT_N];
+extern PGM_P const audit_names[AUDIT_N] PROGMEM;
+#ifdef PROF
+extern volatile u_long prof_isrcycles;
+#endif
+
+/*
+ * Timer1 runs free at clk/1. Times start after the handler prologue
+ * and blocked is how long until interrupts came back on (the whole
+ * run if they never did).
+ */
+#define AUDIT_ENTER() \
+	uint16_t audit_t0 = TCNT1; \
+	uint16_t audit_b = 0
+/* For ISR_NOBLOCK handlers; interrupts are already on */
+#define AUDIT_ENTER_NOBLOCK() \
+	uint16_t audit_t0 = TCNT1; \
+	uint16_t audit_b = 1
+#define AUDIT_SEI() \
+	do { \
+		audit_b = (TCNT1 - audit_t0) | 1; \
+		sei(); \
+	} while (0)
+#define AUDIT_EXIT(id)	audit_exit((id), audit_t0, audit_b)
+
+static inline void
+audit_exit(uint8_t id, uint16_t t0, uint16_t b)
+{
+	uint8_t s;
+	uint16_t d;
+	struct audit *ap;
+
+	s = SREG;
+	cli();
+	d = TCNT1 - t0;
+	if (b == 0)
+		b = d;
+	/* Auto-baud borrows Timer1 at clk/8 */
+	if ((TCCR1B & 0x07) == _BV(CS11)) {
+		d <<= 3;
+		b <<= 3;
+	}
+	ap = &audits[id];
+	if (d > ap->max)
+		ap->max = d;
+	if (b > ap->blocked)
+		ap->blocked = b;
+	++ap->runs;
+#ifdef PROF
+	ap->cycles += d;
+	prof_isrcycles += d;
+#endif
+	SREG = s;
+}
+
+extern void audit_cmd(char *);
+extern void audit_init(void);
+#else
+#define AUDIT_ENTER()
+#define AUDIT_ENTER_NOBLOCK()
+#define AUDIT_SEI()	sei()
+#define AUDIT_EXIT(id)
+#endif
+#endif
@@ -0,0 +1,172 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * Capture port auto-baud
+ *
+ * While the UART0 receiver is off the pin change interrupt on RXD0 (PCINT24)
+ * timestamps edges with Timer1 at clk/8; the shortest interval
+ * between edges is one bit time. Each window of AB_EDGES edges
+ * yields a candidate from the speeds table and two windows in a row
+ * that agree lock it in and turn UART0 back on. Intervals that
+ * span a Timer1 overflow are thrown away.
+ *
+ * Edge timing is interrupt driven so it's only good to around
+ * 115200; above that the interrupt can't keep up.
+ */
+
+#if __has_include("local.h")
+#include "local.h"
+#endif
+
+#include "sdlogger.h"
+
+#include "audit.h"
+#include "autobaud.h"
+#include "serial.h"
+
+/* Edges per measurement window */
+#define AB_EDGES	64
+
+/* Timer1 rate */
+#define AB_HZ		(F_CPU / 8)
+
+/* Give up on a window (no data) after this long */
+#define AB_WINDOW_MS	2000L
+
+/* Locals */
+static boolean ab_active;
+static uint8_t ab_tccr1a;		/* saved Timer1 setup */
+static uint8_t ab_tccr1b;
+static uint32_t ab_last;		/* previous candidate */
+static u_long ab_startms;		/* msec when the window started */
+
+static volatile uint8_t ab_nedges;
+static volatile uint16_t ab_minw;	/* shortest interval (Timer1 ticks) */
+static uint16_t ab_lastt;
+
+/* Forwards */
+static void ab_arm(void);
+
+ISR(PCINT3_vect)
+{
+	uint16_t t, d;
+	AUDIT_ENTER();
+
+	t = TCNT1;
+	d = t - ab_lastt;
+	ab_lastt = t;
+	if ((TIFR1 & _BV(TOV1)) != 0) {
+		/* Too long (or wrapped); start over from this edge */
+		TIFR1 = _BV(TOV1);
+		AUDIT_EXIT(AUDIT_AB);
+		return;
+	}
+	if (ab_nedges > 0 && d < ab_minw)
+		ab_minw = d;
+	if (++ab_nedges >= AB_EDGES)
+		PCICR &= ~_BV(PCIE3);
+	AUDIT_EXIT(AUDIT_AB);
+}
+
+boolean
+autobaud_active(void)
+{
+	return (ab_active);
+}
+
+/* Start a new window */
+static void
+ab_arm(void)
+{
+	uint8_t s;
+
+	s = SREG;
+	cli();
+	ab_nedges = 0;
+	ab_minw = 0xffff;
+	ab_lastt = TCNT1;
+	TIFR1 = _BV(TOV1);
+	PCIFR = _BV(PCIF3);
+	PCICR |= _BV(PCIE3);
+	SREG = s;
+	ab_startms = msec;
+}
+
+/* Scheduler task */
+void
+autobaud_poll(void)
+{
+	uint16_t w;
+	uint32_t speed, lo, hi;
+
+	if (!ab_active)
+		return;
+	if (ab_nedges < AB_EDGES) {
+		/* Quiet line (or not enough single bits) */
+		if (MILLIS_SUB(msec, ab_startms) >= AB_WINDOW_MS) {
+			ab_last = 0;
+			ab_arm();
+		}
+		return;
+	}
+
+	/* The interval is +/- one tick */
+	w = ab_minw;
+	speed = 0;
+	if (w > 1 && w != 0xffff) {
+		lo = AB_HZ / (w + 1);
+		hi = AB_HZ / (w - 1);
+		speed = serial_matchspeed(AB_HZ / w, lo - (lo / 20),
+		    hi + (hi / 20));
+	}
+	if (debug > 1)
+		DPRINTF("autobaud: %u ticks, %lu\n", w, speed);
+	if (speed != 0 && speed == ab_last) {
+		autobaud_stop();
+		capture_begin(speed);
+		DPRINTF("autobaud: locked at %lu\n", speed);
+		return;
+	}
+	ab_last = speed;
+	ab_arm();
+}
+
+/* Turn off UART0 and start measuring */
+void
+autobaud_start(void)
+{
+	uint8_t s;
+
+	/* Receiver off; leave what's in the RX ring alone */
+	UCSR0B &= ~(_BV(RXEN0) | _BV(RXCIE0));
+	if (!ab_active) {
+		s = SREG;
+		cli();
+		ab_tccr1a = TCCR1A;
+		ab_tccr1b = TCCR1B;
+		TCCR1A = 0;
+		TCCR1B = _BV(CS11);
+		PCMSK3 |= _BV(PCINT24);
+		SREG = s;
+		ab_active = 1;
+	}
+	ab_last = 0;
+	ab_arm();
+	SERIAL_PUTSTR("autobaud: listening\n");
+}
+
+/* Give Timer1 and the RXD0 pin change back */
+void
+autobaud_stop(void)
+{
+	uint8_t s;
+
+	s = SREG;
+	cli();
+	PCICR &= ~_BV(PCIE3);
+	PCMSK3 &= ~_BV(PCINT24);
+	TCCR1A = ab_tccr1a;
+	TCCR1B = ab_tccr1b;
+	SREG = s;
+	ab_active = 0;
+}
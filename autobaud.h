@@ -0,0 +1,9 @@
+/* @(#) $Id$ (XSE) */
+
+#ifndef _autobaud_h
+#define _autobaud_h
+extern boolean autobaud_active(void);
+extern void autobaud_poll(void);
+extern void autobaud_start(void);
+extern void autobaud_stop(void);
+#endif
@@ -7,24 +7,72 @@
 #include <ctype.h>
 #include <string.h>
 
-#include <Wire.h>
-
 #include "sdlogger.h"
 
+#include "audit.h"
 #include "cmd.h"
+#include "config.h"
 #include "eeprom.h"
+#include "fat.h"
+#include "grep.h"
+#include "prof.h"
 #include "rtc.h"
+#include "sched.h"
+#include "sdlat.h"
 #include "serial.h"
 #include "sstrings.h"
+#include "stats.h"
 #include "status.h"
+#include "tail.h"
+#include "trace.h"
 #include "util.h"
 #include "version.h"
+#include "xfer.h"
+
+/*
+ * cat, ls, tail, grep and xfer run as jobs, a slice each time
+ * cmd_poll() runs (which the scheduler holds off while the capture
+ * ring is backed up). A cat, ls or tail slice only emits what fits
+ * in the console ring so it never waits.
+ */
+#define JOB_NONE	0
+#define JOB_CAT		1
+#define JOB_LS		2
+#define JOB_TAIL	3
+#define JOB_XFER	4		/* see xfer.cpp */
+#define JOB_GREP	5		/* see grep.cpp */
+
+#define JOB_CATSLICE	128		/* file bytes per slice */
+#define JOB_CATROOM	5		/* a newline and a \ooo escape */
+#define JOB_LSSLICE	16		/* directory entries per slice */
+#define JOB_LSDEPTH	4		/* ls doesn't descend further */
+#define JOB_LSNAME	14		/* name column */
+/* One ls line: indent, name, date, time, " size" and a newline */
+#define JOB_LSROOM \
+    (2 * (JOB_LSDEPTH - 1) + JOB_LSNAME + 10 + 1 + 8 + 11 + 1)
+#define JOB_TAILROOM	24		/* a dropped note */
+#define JOB_TAILMS	1000L		/* between dropped notes */
+
+/* Globals */
+uint8_t cmd_jobbuf[CMD_JOBBUFSIZE];
 
 /* Locals */
+static uint8_t job;
+static SdFile jfiles[JOB_LSDEPTH];	/* cat's file or ls's directories */
+static uint8_t jdepth;			/* jfiles[] in use */
+static uint16_t jlen;
+static uint16_t jpos;
+static boolean jsawcr;
+static boolean jsawnl;
+static u_long jnotems;			/* tail's last dropped note */
 
 /* Forwards */
+static void cat_byte(char);
+static boolean cat_slice(void);
 static void cmd_cmd(char *);
-static void ls(SdFile, uint8_t flags = 0, uint8_t indent = 0);
+static void cmd_job(void);
+static boolean ls_slice(void);
+static boolean tail_slice(void);
 static void printDirName(const dir_t&, uint8_t);
 static void printFatDate(uint16_t);
 static void printFatTime(uint16_t);
@@ -34,14 +82,13 @@ static void
 cmd_cmd(char *s)
 {
 	u_long uv;
-	int16_t v;
-	uint16_t u16;
-	boolean sawcr, sawnl;
-	char ch, *p, *ep;
+	uint16_t u16, u16b;
+	char *p, *ep;
 	SdFile tfile;
 
 	if (*s == '\0')
 		goto done;
+	trace(TRACE_CMD, ((uint8_t)s[0] << 8) | (uint8_t)s[1]);
 
 	if (strncmp_P(s, PSTR("cat"), 3) == 0) {
 		s += 3;
@@ -52,55 +99,75 @@ cmd_cmd(char *s)
 			++s;
 		if (*s == '\0')
 			goto help;
-		if (!tfile.open(&curdir, s, O_READ)) {
+		jfiles[0] = SdFile();
+		if (!jfiles[0].open(&curdir, s, O_READ)) {
 			PRINTF("Can't open %s\n", s);
 			goto done;
 		}
-		if (tfile.isDir() || tfile.isSubDir()) {
+		if (jfiles[0].isDir() || jfiles[0].isSubDir()) {
 			SERIAL_PUTSTR("Can't cat directory\n");
-			tfile.close();
+			jfiles[0].close();
 			goto done;
 		}
 
-		/* Cat the file displaying unprintable */
-		sawcr = 0;
-		sawnl = 1;
-		while ((v = tfile.read()) != -1) {
-			ch = v;
-			sawnl = 0;
-			if (ch == '\r') {
-				sawcr = 1;
-				continue;
-			}
-			if (ch == '\n') {
-				serial_nl();
-				sawnl = 1;
-				sawcr = 0;
-				continue;
-			}
-			if (sawcr)
-				serial_nl();
-			sawcr = 0;
-			if (isblank(ch)) {
-				serial_putchar(ch);
-				continue;
-			}
-			if (!isprint(ch)) {
-				PRINTF("\\%03o", ch);
-				continue;
-			}
-			serial_putchar(ch);
-		}
-		tfile.close();
-		if (!sawnl)
-			serial_nl();
+		/* cmd_job() does the rest and the prompt */
+		jdepth = 1;
+		jlen = 0;
+		jpos = 0;
+		jsawcr = 0;
+		jsawnl = 1;
+		(void)serial_intr();
+		job = JOB_CAT;
+		return;
+	}
+
+	if (strncmp_P(s, PSTR("get "), 4) == 0) {
+		config_get(s + 4);
+		goto done;
+	}
+
+	if (strncmp_P(s, PSTR("grep"), 4) == 0) {
+		s += 4;
+		if (!isblank(*s))
+			goto help;
+		if (!grep_cmd(s))
+			goto done;
+		(void)serial_intr();
+		job = JOB_GREP;
+		return;
+	}
 
+#ifdef ISR_AUDIT
+	if (strncmp_P(s, PSTR("isr"), 3) == 0) {
+		audit_cmd(s + 3);
+		goto done;
+	}
+#endif
+
+	if (strcmp_P(s, PSTR("list")) == 0) {
+		config_list();
 		goto done;
 	}
 
 	if (strcmp_P(s, PSTR("ls")) == 0) {
 		PRINTF("Volume is FAT %d\n", volume.fatType());
-		ls(curdir, LS_DATE | LS_SIZE | LS_R);
+		jfiles[0] = curdir;
+		jfiles[0].rewind();
+		jdepth = 1;
+		(void)serial_intr();
+		job = JOB_LS;
+		return;
+	}
+
+#ifdef PROF
+	if (strncmp_P(s, PSTR("prof"), 4) == 0) {
+		prof_cmd(s + 4);
+		goto done;
+	}
+#endif
+
+	if (strncmp_P(s, PSTR("ring"), 4) == 0) {
+		stats_cmd(s + 4);
 		goto done;
 	}
 
@@ -132,6 +199,59 @@ cmd_cmd(char *s)
 		goto done;
 	}
 
+	if (strncmp_P(s, PSTR("sdlat"), 5) == 0) {
+		sdlat_cmd(s + 5);
+		goto done;
+	}
+
+	if (strncmp_P(s, PSTR("set "), 4) == 0) {
+		config_set(s + 4);
+		goto done;
+	}
+
+	if (strncmp_P(s, PSTR("tasks"), 5) == 0) {
+		sched_cmd(s + 5);
+		goto done;
+	}
+
+	if (strncmp_P(s, PSTR("tail"), 4) == 0) {
+		s += 4;
+		while (isblank(*s))
+			++s;
+		uv = TAIL_SIZE;
+		if (*s != '\0') {
+			uv = strtoul(s, &ep, 10);
+			if (*ep != '\0') {
+				serial_putstr(FV(msg_badvalue));
+				goto done;
+			}
+		}
+
+		/* cmd_job() follows until ^C */
+		tail_start(min(uv, TAIL_SIZE));
+		jsawcr = 0;
+		jsawnl = 1;
+		jnotems = millis();
+		(void)serial_intr();
+		job = JOB_TAIL;
+		return;
+	}
+
+	if (strncmp_P(s, PSTR("trace"), 5) == 0) {
+		trace_cmd(s + 5);
+		goto done;
+	}
+
+	if (strncmp_P(s, PSTR("xfer"), 4) == 0) {
+		/* Binary transfers run as a job, the rest are immediate */
+		if (xfer_cmd(s + 4)) {
+			(void)serial_intr();
+			job = JOB_XFER;
+			return;
+		}
+		goto done;
+	}
+
 	if (strcmp_P(s, PSTR("zero")) == 0) {
 		/* Zero the newseq counter */
 		eeprom.logseq = 0;
@@ -188,6 +308,24 @@ cmd_cmd(char *s)
 		PRINTF("data size: %5d\n",
 		    (int)&__data_end - (int)&__data_start);
 		PRINTF(" ram left: %5u\n", stackptr - heapptr);
+		u16 = stack_max(&u16b);
+		PRINTF("stack max: %5u\n", u16);
+		PRINTF("never used: %4u\n", u16b);
+		/* The big buffers */
+		PRINTF("  capture: %5u\n", UART0_SIZE);
+		PRINTF(" sd cache: %5u\n", sizeof(cache_t));
+		PRINTF("  console: %5u\n", serial_ram());
+		PRINTF("    chunk: %5u\n", CONFIG_CHUNK_MAX);
+		if (u16b > STACK_MARGIN) {
+			u16 = UART0_SIZE + u16b - STACK_MARGIN;
+			PRINTF("UART0_SIZE could be %u", u16);
+			/* The capture ring is fastest at a power of two */
+			for (u16b = 1; u16b <= u16 / 2; u16b <<= 1)
+				continue;
+			if (u16b != u16)
+				PRINTF(" (%u is a power of two)", u16b);
+			serial_nl();
+		}
 		break;
 
 	case 'R':
@@ -199,11 +337,21 @@ cmd_cmd(char *s)
 	case 's':
 		/* Show things */
 		PRINTF("logseq: %d\n", eeprom.logseq);
+		PRINTF("rx ring: %d bytes, %lu lost\n",
+		    NewSerial.available(), NewSerial.getRxLost());
 		SERIAL_PUTSTR("status:");
 		if ((status & STATUS_STATE_ERROR) != 0)
 			SERIAL_PUTSTR(" ERROR");
 		if ((status & STATUS_STATE_DIRTY) != 0)
 			SERIAL_PUTSTR(" DIRTY");
+		if ((status & STATUS_STATE_RECOVERING) != 0)
+			SERIAL_PUTSTR(" RECOVERING");
+		if ((status & STATUS_STATE_FAILED) != 0)
+			SERIAL_PUTSTR(" FAILED");
+		if ((status & STATUS_STATE_PAUSED) != 0)
+			SERIAL_PUTSTR(" PAUSED");
+		if ((status & STATUS_STATE_ARMED) != 0)
+			SERIAL_PUTSTR(" ARMED");
 		serial_nl();
 		showdisk();
 		break;
@@ -211,7 +359,12 @@ cmd_cmd(char *s)
 	case 'S':
 		/* Card status */
 		SERIAL_PUTSTR("logger status is ");
-		SERIAL_PRONE(STATUS_ERROR(status), "error", "ok");
+		if (STATUS_FAILED(status))
+			SERIAL_PUTSTR("failed");
+		else if (STATUS_RECOVERING(status))
+			SERIAL_PUTSTR("recovering");
+		else
+			SERIAL_PRONE(STATUS_ERROR(status), "error", "ok");
 		serial_nl();
 		SERIAL_PUTSTR("filesystem is ");
 		SERIAL_PRONE(STATUS_DIRTY(status), "dirty", "clean");
@@ -241,10 +394,30 @@ cmd_cmd(char *s)
 	case 'h':
 		/* help */
 		SERIAL_PUTSTR(
-		    "\"cat\"\tdisplay a file\n"
-		    "\"ls\"\tlist files\n"
+		    "\"cat\"\tdisplay a file (^C to stop)\n"
+		    "\"get\"\tshow a setting\n"
+		    "\"grep\"\tshow lines of a file with a string "
+		    "(\"grep string file\", ^C to stop)\n"
+#ifdef ISR_AUDIT
+		    "\"isr\"\tinterrupt timing (\"isr reset\" to clear)\n"
+#endif
+		    "\"list\"\tlist settings\n"
+		    "\"ls\"\tlist files (^C to stop)\n"
+#ifdef PROF
+		    "\"prof\"\tCPU profile (\"prof N\" every N secs, "
+		    "\"prof reset\")\n"
+#endif
+		    "\"ring\"\tcapture ring stats (\"ring reset\" to clear)\n"
 		    "\"rm\"\tremove a file\n"
+		    "\"sdlat\"\tSD latency (\"sdlat reset\" to clear)\n"
+		    "\"set\"\tchange a setting (\"set name value\")\n"
 		    "\"sync\"\tsync file and directory\n"
+		    "\"tail\"\tfollow capture (\"tail N\" from N bytes back, "
+		    "^C to stop)\n"
+		    "\"tasks\"\ttask stats (\"tasks reset\" to clear)\n"
+		    "\"trace\"\tdump the event trace (\"trace clear\" to restart)\n"
+		    "\"xfer\"\tfile transfer (\"xfer ls\", \"xfer get name "
+		    "[offset [length]]\", \"xfer speed N\")\n"
 		    "\"zero\"\tzero newseq\n"
 		    "'d'\tdebug level\n"
 		    "'e'\teeprom cmd\n"
@@ -271,19 +444,148 @@ done:
 	serial_putstr(FV(msg_prompt));
 }
 
+/* Output a byte of cat or tail (up to JOB_CATROOM) displaying unprintable */
+static void
+cat_byte(char ch)
+{
+	jsawnl = 0;
+	if (ch == '\r') {
+		jsawcr = 1;
+		return;
+	}
+	if (ch == '\n') {
+		serial_nl();
+		jsawnl = 1;
+		jsawcr = 0;
+		return;
+	}
+	if (jsawcr)
+		serial_nl();
+	jsawcr = 0;
+	if (isblank(ch) || isprint(ch))
+		serial_putchar(ch);
+	else
+		PRINTF("\\%03o", (uint8_t)ch);
+}
+
+/* Copy some of the file to the console, returns 0 when it's done */
+static boolean
+cat_slice(void)
+{
+	uint8_t i;
+	int16_t n;
+
+	for (i = JOB_CATSLICE; i > 0; --i) {
+		if (serial_room() < JOB_CATROOM)
+			return (1);
+		if (jpos >= jlen) {
+			n = jfiles[0].read(cmd_jobbuf, sizeof(cmd_jobbuf));
+			if (n <= 0) {
+				if (!jsawnl)
+					serial_nl();
+				return (0);
+			}
+			jlen = n;
+			jpos = 0;
+		}
+
+		cat_byte(cmd_jobbuf[jpos++]);
+	}
+	return (1);
+}
+
+/* True while a job (and so cmd_jobbuf[]) is running */
+boolean
+cmd_busy(void)
+{
+	return (job != JOB_NONE);
+}
+
 void
 cmd_init(void)
 {
 	SdFile::dateTimeCallback(rtc_datetime);
 }
 
+/* Copy new capture data to the console, runs until ^C */
+static boolean
+tail_slice(void)
+{
+	uint8_t i;
+	int c;
+	u_long n;
+
+	/* Note what was skipped now and then */
+	n = tail_dropped(0);
+	if (n > 0 && MILLIS_SUB(millis(), jnotems) >= JOB_TAILMS &&
+	    serial_room() >= JOB_TAILROOM) {
+		if (!jsawnl)
+			serial_nl();
+		PRINTF("[dropped %lu]\n", n);
+		(void)tail_dropped(1);
+		jsawcr = 0;
+		jsawnl = 1;
+		jnotems = millis();
+	}
+
+	for (i = JOB_CATSLICE; i > 0; --i) {
+		if (serial_room() < JOB_CATROOM)
+			break;
+		c = tail_get();
+		if (c < 0)
+			break;
+		cat_byte(c);
+	}
+	return (1);
+}
+
+/* Run a slice of the current job; typed lines wait until it's done */
+static void
+cmd_job(void)
+{
+	boolean more, intr;
+
+	intr = serial_intr();
+	if (intr)
+		more = 0;
+	else if (job == JOB_XFER)
+		more = xfer_slice();
+	else if (job == JOB_TAIL)
+		more = tail_slice();
+	else if (!STATUS_PRESENT(status))
+		more = 0;
+	else if (job == JOB_CAT)
+		more = cat_slice();
+	else if (job == JOB_GREP)
+		more = grep_slice();
+	else
+		more = ls_slice();
+	if (more)
+		return;
+
+	if (job == JOB_XFER)
+		xfer_end();
+	else if (job == JOB_GREP)
+		grep_end();
+	while (jdepth > 0)
+		jfiles[--jdepth].close();
+	if (intr)
+		SERIAL_PUTSTR("^C\n");
+	job = JOB_NONE;
+	serial_putstr(FV(msg_prompt));
+}
+
 void
 cmd_poll(void)
 {
 	char buf[64];
+	PROF_SET(PROF_CONSOLE);
 
-	if (serial_getln(buf, sizeof(buf)))
+	if (job != JOB_NONE)
+		cmd_job();
+	else if (serial_getln(buf, sizeof(buf)))
 		cmd_cmd(buf);
+	PROF_RESTORE();
 }
 
 /* SdFile::printDirName() that uses NewSerial */
@@ -326,60 +628,62 @@ printFatTime(uint16_t fatTime)
 	    FAT_HOUR(fatTime), FAT_MINUTE(fatTime), FAT_SECOND(fatTime));
 }
 
-/* SdFile::ls() that uses NewSerial */
-static void
-ls(SdFile dp, uint8_t flags, uint8_t indent)
+/* SdFile::ls() a few entries at a time, returns 0 when it's done */
+static boolean
+ls_slice(void)
 {
-	int8_t i;
-	dir_t d, *p;
-
-	p = &d;
-	dp.rewind();
-	while (dp.readDir(*p) > 0) {
-		/* done if past last used entry */
-		if (p->name[0] == DIR_NAME_FREE)
-			break;
+	uint8_t i;
+	uint16_t index;
+	dir_t d;
+	SdFile *dp;
+
+	for (i = JOB_LSSLICE; i > 0; --i) {
+		if (serial_room() < JOB_LSROOM)
+			return (1);
+		dp = &jfiles[jdepth - 1];
+
+		/* done with this directory if past last used entry */
+		if (dp->readDir(d) <= 0 || d.name[0] == DIR_NAME_FREE) {
+			if (--jdepth == 0)
+				return (0);
+			dp->close();
+			continue;
+		}
 
 		/* skip deleted */
-		if (p->name[0] == DIR_NAME_DELETED)
+		if (d.name[0] == DIR_NAME_DELETED)
 			continue;
 
 		/* skip dot files */
-		if (p->name[0] == '.')
+		if (d.name[0] == '.')
 			continue;
 
 		/* skip if directory */
-		if (!DIR_IS_FILE_OR_SUBDIR(p))
+		if (!DIR_IS_FILE_OR_SUBDIR(&d))
 			continue;
 
 		/* Indent */
-		for (i = indent; i > 0; --i)
-			serial_putchar(' ');
-
-		/* Print the name */
-		printDirName(*p, (flags & (LS_DATE | LS_SIZE)) ? 14 : 0);
+		for (index = jdepth - 1; index > 0; --index)
+			SERIAL_PUTSTR("  ");
 
-		/* Print date/time */
-		if (flags & LS_DATE) {
-			printFatDate(p->lastWriteDate);
-			serial_putchar(' ');
-			printFatTime(p->lastWriteTime);
-		}
-
-		/* print size if requested */
-		if (!DIR_IS_SUBDIR(p) && (flags & LS_SIZE) != 0)
-			PRINTF(" %lu", p->fileSize);
+		/* Print the name, date/time and size */
+		printDirName(d, JOB_LSNAME);
+		printFatDate(d.lastWriteDate);
+		serial_putchar(' ');
+		printFatTime(d.lastWriteTime);
+		if (!DIR_IS_SUBDIR(&d))
+			PRINTF(" %lu", d.fileSize);
 		serial_nl();
 
-		/* list subdirectory content if requested */
-		if ((flags & LS_R) && DIR_IS_SUBDIR(p)) {
-			uint16_t index = (dp.curPosition() / 32) - 1;
-			SdFile s;
-			if (s.open(dp, index, O_READ))
-				ls(s, flags, indent + 2);
-			dp.seekSet(32 * (index + 1));
+		/* list subdirectory content (to a point) */
+		if (DIR_IS_SUBDIR(&d) && jdepth < JOB_LSDEPTH) {
+			index = (dp->curPosition() / 32) - 1;
+			jfiles[jdepth] = SdFile();
+			if (jfiles[jdepth].open(dp, index, O_READ))
+				++jdepth;
 		}
 	}
+	return (1);
 }
 
 static void
@@ -435,4 +739,6 @@ showdisk(void)
 
 	/* 512 blocks -> kbytes */
 	PRINTF("card size: %lu KB\n", cardSize / 2);
+	if (fat_free() != FAT_UNKNOWN)
+		PRINTF("free: %lu KB\n", fat_free());
 }
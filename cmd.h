@@ -2,6 +2,15 @@
 
 #ifndef _cmd_h
 #define _cmd_h
+/*
+ * Sector buffer for the console job that's running (cat, xfer);
+ * fat_poll() borrows it when there's no job
+ */
+#define CMD_JOBBUFSIZE	512
+
+extern uint8_t cmd_jobbuf[CMD_JOBBUFSIZE];
+
+extern boolean cmd_busy(void);
 extern void cmd_init(void);
 extern void cmd_poll(void);
 #endif
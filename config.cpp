@@ -0,0 +1,245 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * Runtime configuration
+ *
+ * Each tunable is a field in struct eeprom described by an entry
+ * in a PROGMEM table (name, size, range and default) so the console
+ * can get, set and list them and eeprom_init() can repair values
+ * that are out of range (e.g. fields an old eeprom record doesn't
+ * have). Changes take effect right away.
+ */
+
+#if __has_include("local.h")
+#include "local.h"
+#endif
+
+#include <stddef.h>
+
+#include "sdlogger.h"
+
+#include "config.h"
+#include "eeprom.h"
+#include "serial.h"
+#include "sstrings.h"
+
+struct config {
+	PGM_P name;
+	PGM_P help;
+	uint8_t off;			/* in struct eeprom */
+	uint8_t size;			/* 1, 2 or 4 */
+	uint32_t min;
+	uint32_t max;
+	uint32_t def;
+	boolean (*valid)(uint32_t);	/* extra validation */
+	void (*apply)(void);		/* called after a set */
+};
+
+#define CF(f) offsetof(struct eeprom, f), sizeof(((struct eeprom *)0)->f)
+
+/* Forwards */
+static void config_applydebug(void);
+static void config_applyspeed(void);
+static const struct config *config_find(const char *, struct config *);
+static uint32_t config_getval(const struct config *);
+static void config_pr(const struct config *);
+static void config_setval(const struct config *, uint32_t);
+static boolean config_validspeed(uint32_t);
+
+static const char cn_chunk[] PROGMEM = "chunk";
+static const char cn_debug[] PROGMEM = "debug";
+static const char cn_idle[] PROGMEM = "idle";
+static const char cn_naming[] PROGMEM = "naming";
+static const char cn_rotate[] PROGMEM = "rotate";
+static const char cn_speed[] PROGMEM = "speed";
+static const char cn_sync[] PROGMEM = "sync";
+
+static const char ch_chunk[] PROGMEM = "bytes per SD write";
+static const char ch_debug[] PROGMEM = "debug level";
+static const char ch_idle[] PROGMEM = "sync after this much idle (ms)";
+static const char ch_naming[] PROGMEM = "0 auto, 1 date, 2 LOGnnnnn, 3 SEQLOG";
+static const char ch_rotate[] PROGMEM = "new log after this many KB (0 off)";
+static const char ch_speed[] PROGMEM = "capture baud rate (0 auto)";
+static const char ch_sync[] PROGMEM = "sync this often while busy (ms, 0 off)";
+
+static const struct config configs[] PROGMEM = {
+	{ cn_chunk, ch_chunk, CF(chunk),
+	    1, CONFIG_CHUNK_MAX, 32, NULL, NULL },
+	{ cn_debug, ch_debug, CF(debug),
+	    0, 0xfe, 0, NULL, config_applydebug },
+	{ cn_idle, ch_idle, CF(idlems),
+	    10, 60000, MAX_IDLE_MS, NULL, NULL },
+	{ cn_naming, ch_naming, CF(naming),
+	    CONFIG_NAME_AUTO, CONFIG_NAME_SEQ, CONFIG_NAME_AUTO, NULL, NULL },
+	{ cn_rotate, ch_rotate, CF(rotatekb),
+	    0, 65000, 0, NULL, NULL },
+	{ cn_speed, ch_speed, CF(speed),
+	    0, 0xfffffffe, UART0_BAUD, config_validspeed, config_applyspeed },
+	{ cn_sync, ch_sync, CF(syncms),
+	    0, 60000, 1000, NULL, NULL },
+};
+#define NCONFIGS ((uint8_t)(sizeof(configs) / sizeof(configs[0])))
+
+static void
+config_applydebug(void)
+{
+	debug = eeprom.debug;
+}
+
+static void
+config_applyspeed(void)
+{
+	capture_speed(eeprom.speed);
+}
+
+/* Set out of range values to their defaults, returns 1 if any changed */
+boolean
+config_check(void)
+{
+	uint8_t i;
+	uint32_t v;
+	boolean didany;
+	struct config c;
+
+	didany = 0;
+	for (i = 0; i < NCONFIGS; ++i) {
+		memcpy_P(&c, &configs[i], sizeof(c));
+		v = config_getval(&c);
+		if (v < c.min || v > c.max ||
+		    (c.valid != NULL && !(*c.valid)(v))) {
+			config_setval(&c, c.def);
+			didany = 1;
+		}
+	}
+	return (didany);
+}
+
+/* Lookup by name, returns NULL if not found */
+static const struct config *
+config_find(const char *name, struct config *cp)
+{
+	uint8_t i;
+
+	for (i = 0; i < NCONFIGS; ++i) {
+		memcpy_P(cp, &configs[i], sizeof(*cp));
+		if (strcmp_P(name, cp->name) == 0)
+			return (cp);
+	}
+	serial_putstr(FV(msg_badvalue));
+	SERIAL_PUTSTR("(\"list\" shows the names)\n");
+	return (NULL);
+}
+
+void
+config_get(char *s)
+{
+	struct config c;
+
+	while (isblank(*s))
+		++s;
+	if (config_find(s, &c) != NULL)
+		config_pr(&c);
+}
+
+static uint32_t
+config_getval(const struct config *cp)
+{
+	uint8_t *p;
+
+	p = (uint8_t *)&eeprom + cp->off;
+	switch (cp->size) {
+
+	case 1:
+		return (*p);
+
+	case 2:
+		return (*(uint16_t *)p);
+
+	default:
+		return (*(uint32_t *)p);
+	}
+}
+
+void
+config_list(void)
+{
+	uint8_t i;
+	struct config c;
+
+	for (i = 0; i < NCONFIGS; ++i) {
+		memcpy_P(&c, &configs[i], sizeof(c));
+		config_pr(&c);
+	}
+}
+
+static void
+config_pr(const struct config *cp)
+{
+	PRINTF("%-7S %7lu  %S\n", cp->name, config_getval(cp), cp->help);
+}
+
+void
+config_set(char *s)
+{
+	char *name, *ep;
+	uint32_t v;
+	struct config c;
+
+	while (isblank(*s))
+		++s;
+	name = s;
+	while (*s != '\0' && !isblank(*s))
+		++s;
+	if (*s == '\0') {
+		serial_putstr(FV(msg_errmsg));
+		return;
+	}
+	*s++ = '\0';
+	if (config_find(name, &c) == NULL)
+		return;
+	while (isblank(*s))
+		++s;
+	v = strtoul(s, &ep, 10);
+	if (*s == '\0' || *ep != '\0' || v < c.min || v > c.max ||
+	    (c.valid != NULL && !(*c.valid)(v))) {
+		serial_putstr(FV(msg_badvalue));
+		PRINTF("%S: %lu to %lu\n", c.name, c.min, c.max);
+		return;
+	}
+	/* Setting what's already there doesn't apply (split the log) again */
+	if (config_getval(&c) != v) {
+		config_setval(&c, v);
+		if (c.apply != NULL)
+			(*c.apply)();
+		(void)eeprom_write(1);
+	}
+	config_pr(&c);
+}
+
+static void
+config_setval(const struct config *cp, uint32_t v)
+{
+	uint8_t *p;
+
+	p = (uint8_t *)&eeprom + cp->off;
+	switch (cp->size) {
+
+	case 1:
+		*p = v;
+		break;
+
+	case 2:
+		*(uint16_t *)p = v;
+		break;
+
+	default:
+		*(uint32_t *)p = v;
+		break;
+	}
+}
+
+static boolean
+config_validspeed(uint32_t v)
+{
+	return (v == 0 || serial_speed(v));
+}
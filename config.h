@@ -0,0 +1,18 @@
+/* @(#) $Id$ (XSE) */
+
+#ifndef _config_h
+#define _config_h
+/* Log file naming (eeprom.naming) */
+#define CONFIG_NAME_AUTO	0	/* date, then numbered, then sequential */
+#define CONFIG_NAME_DATE	1	/* encoded date and time */
+#define CONFIG_NAME_NEW		2	/* LOG%05d.TXT */
+#define CONFIG_NAME_SEQ		3	/* SEQLOG00.TXT */
+
+/* Largest chunk moved from the RX ring per file.write() */
+#define CONFIG_CHUNK_MAX	128
+
+extern boolean config_check(void);
+extern void config_get(char *);
+extern void config_list(void);
+extern void config_set(char *);
+#endif
@@ -1,5 +1,15 @@
 /* @(#) $Id: eeprom.cpp 175 2026-08-02 22:59:36Z leres $ (XSE) */
 
+/*
+ * Persistent settings
+ *
+ * struct eeprom is journalled: each eeprom_write() appends a
+ * versioned, CRC protected record to the next slot (wrapping
+ * around the whole EEPROM to spread the wear) and the EE_READY
+ * interrupt writes it a byte at a time so nobody waits 3.3 ms per
+ * byte. A torn record fails its CRC and the previous one is used.
+ */
+
 #if __has_include("local.h")
 #include "local.h"
 #endif
@@ -7,15 +17,147 @@
 #include "sdlogger.h"
 
 #include <EEPROM.h>
+#include <util/crc16.h>
 
+#include "audit.h"
 #include "cmd.h"
+#include "config.h"
 #include "eeprom.h"
 #include "serial.h"
 #include "sstrings.h"
 
+/* Record header; followed by len bytes of struct eeprom and the crc */
+struct eeprom_hdr {
+	uint16_t seq;
+	uint8_t version;
+	uint8_t len;
+};
+
+#define EEPROM_RECSIZE(len) (sizeof(struct eeprom_hdr) + (len) + 2)
+
 /* Globals */
 struct eeprom eeprom;
 
+/* Locals */
+static struct eeprom ee_saved;		/* last copy handed to the journal */
+static boolean ee_have;			/* ee_saved is valid */
+static boolean ee_pending;		/* write ee_saved when not busy */
+static boolean ee_verify;		/* check ee_wslot when done */
+static boolean ee_failed;		/* last write didn't verify */
+static uint16_t ee_seq;			/* last sequence number */
+static uint16_t ee_slot;		/* next slot to write */
+static uint16_t ee_wslot;		/* slot being written */
+static uint16_t ee_errors;
+
+/* Interrupt handler state */
+static volatile boolean ee_busy;
+static uint16_t ee_waddr;
+static uint8_t ee_widx;
+static uint8_t ee_wlen;
+static uint8_t ee_wbuf[EEPROM_SLOTSIZE];
+
+/* Forwards */
+static boolean ee_check(uint16_t, struct eeprom_hdr *, struct eeprom *);
+static uint16_t ee_crc(const uint8_t *, uint8_t, uint16_t);
+static void ee_start(void);
+
+ISR(EE_READY_vect)
+{
+	uint8_t b;
+	AUDIT_ENTER();
+
+	/* Level triggered; mask it while we compare with interrupts on */
+	EECR &= ~_BV(EERIE);
+	AUDIT_SEI();
+
+	/* Skip bytes that are already correct */
+	while (ee_widx < ee_wlen) {
+		b = ee_wbuf[ee_widx++];
+		EEAR = ee_waddr++;
+		EECR |= _BV(EERE);
+		if (EEDR != b) {
+			EEDR = b;
+			/* EEPE must follow EEMPE within four cycles */
+			cli();
+			EECR |= _BV(EEMPE);
+			EECR |= _BV(EEPE);
+			EECR |= _BV(EERIE);
+			AUDIT_EXIT(AUDIT_EE);
+			return;
+		}
+	}
+	ee_busy = 0;
+	AUDIT_EXIT(AUDIT_EE);
+}
+
+/* Return 1 if the slot holds a valid record */
+static boolean
+ee_check(uint16_t slot, struct eeprom_hdr *hp, struct eeprom *ep)
+{
+	uint8_t i, n;
+	uint16_t ei, crc, crc2;
+	uint8_t buf[EEPROM_SLOTSIZE];
+
+	ei = EEPROM_JOURNAL_START + (slot * EEPROM_SLOTSIZE);
+	for (i = 0; i < sizeof(*hp); ++i)
+		buf[i] = EEPROM.read(ei + i);
+	memcpy(hp, buf, sizeof(*hp));
+	if (hp->version != EEPROM_VERSION ||
+	    EEPROM_RECSIZE(hp->len) > EEPROM_SLOTSIZE)
+		return (0);
+	n = sizeof(*hp) + hp->len;
+	for (; i < n; ++i)
+		buf[i] = EEPROM.read(ei + i);
+	crc = ee_crc(buf, n, 0xffff);
+	crc2 = EEPROM.read(ei + n) | (EEPROM.read(ei + n + 1) << 8);
+	if (crc != crc2)
+		return (0);
+
+	/* Fields a shorter (older) record doesn't have look uninitialized */
+	if (ep != NULL) {
+		memset(ep, 0xff, sizeof(*ep));
+		memcpy(ep, buf + sizeof(*hp), min(hp->len, sizeof(*ep)));
+	}
+	return (1);
+}
+
+static uint16_t
+ee_crc(const uint8_t *p, uint8_t n, uint16_t crc)
+{
+	while (n-- > 0)
+		crc = _crc16_update(crc, *p++);
+	return (crc);
+}
+
+/* Queue ee_saved into the next slot */
+static void
+ee_start(void)
+{
+	uint8_t n;
+	uint16_t crc;
+	struct eeprom_hdr h;
+
+	h.seq = ++ee_seq;
+	h.version = EEPROM_VERSION;
+	h.len = sizeof(ee_saved);
+	memcpy(ee_wbuf, &h, sizeof(h));
+	memcpy(ee_wbuf + sizeof(h), &ee_saved, sizeof(ee_saved));
+	n = sizeof(h) + sizeof(ee_saved);
+	crc = ee_crc(ee_wbuf, n, 0xffff);
+	ee_wbuf[n++] = crc & 0xff;
+	ee_wbuf[n++] = crc >> 8;
+
+	ee_wslot = ee_slot;
+	if (++ee_slot >= EEPROM_NSLOTS)
+		ee_slot = 0;
+	ee_waddr = EEPROM_JOURNAL_START + (ee_wslot * EEPROM_SLOTSIZE);
+	ee_widx = 0;
+	ee_wlen = n;
+	ee_verify = 1;
+	ee_busy = 1;
+	EECR |= _BV(EERIE);
+}
+
 void
 eeprom_cmd(char *s)
 {
@@ -35,24 +177,34 @@ eeprom_cmd(char *s)
 		break;
 
 	case 's':
-		uv = strtoul(p, &ep, 10);
-		if (*ep != '\0' || !serial_speed(uv)) {
+		/* Change the capture speed now; "auto" to detect it */
+		if (*p == '\0') {
+			serial_prbauds();
+			break;
+		}
+		if (strcmp_P(p, PSTR("auto")) == 0) {
+			uv = 0;
+			ep = p + strlen(p);
+		} else
+			uv = strtoul(p, &ep, 10);
+		if (*ep != '\0' || (uv != 0 && !serial_speed(uv))) {
 			serial_putstr(FV(msg_badvalue));
-			SERIAL_PUTSTR("valid speeds:\n");
+			SERIAL_PUTSTR("valid speeds (or auto):\n");
 			serial_prspeeds();
 			break;
 		}
-		if (eeprom.speed != uv) {
-			eeprom.speed = uv;
-			eeprom_write(1);
-		}
+		if (eeprom.speed == uv)
+			break;
+		eeprom.speed = uv;
+		eeprom_write(1);
+		capture_speed(uv);
 		break;
 
 	default:
 		/* help */
 		SERIAL_PUTSTR(
 		    "'er'\treport\n"
-		    "'es'\tspeed\n"
+		    "'es'\tcapture speed (or auto, none for the table)\n"
 		    );
 		break;
 	}
@@ -66,32 +218,81 @@ eeprom_init(void)
 	/* Read the eeprom, set defaults if uninitialized */
 	didany = 0;
 	eeprom_read();
-	if (eeprom.debug == 0xff) {
-		eeprom.debug = 0;
-		didany = 1;
-	}
-	debug = eeprom.debug;
 	if (eeprom.logseq == 0xffff) {
 		eeprom.logseq = 0;
 		didany = 1;
 	}
-	if (!serial_speed(eeprom.speed)) {
-		eeprom.speed = UART0_BAUD;
+	if (config_check())
 		didany = 1;
-	}
-	if (didany)
+	debug = eeprom.debug;
+	if (didany || !ee_have)
 		(void)eeprom_write(1);
 }
 
+/* Scheduler task: verify finished writes and start pending ones */
+void
+eeprom_poll(void)
+{
+	struct eeprom_hdr h;
+
+	if (ee_busy)
+		return;
+	if (ee_verify) {
+		ee_verify = 0;
+		ee_failed = (!ee_check(ee_wslot, &h, NULL) || h.seq != ee_seq);
+		if (ee_failed) {
+			/* Try again in the next slot */
+			++ee_errors;
+			ee_pending = 1;
+			if (debug)
+				serial_dputstr(FV(msg_eepromfail));
+		}
+	}
+	if (ee_pending) {
+		ee_pending = 0;
+		ee_start();
+	}
+}
+
+/* Load the newest journal record (or the old fixed location) */
 void
 eeprom_read(void)
 {
 	int i, ei;
 	u_char *dp;
+	uint16_t slot;
+	boolean found;
+	struct eeprom_hdr h;
+	struct eeprom e;
 
+	/* Let the current write finish */
+	while (ee_busy)
+		continue;
+
+	found = 0;
+	for (slot = 0; slot < EEPROM_NSLOTS; ++slot) {
+		if (!ee_check(slot, &h, &e))
+			continue;
+		if (found && (int16_t)(h.seq - ee_seq) <= 0)
+			continue;
+		found = 1;
+		ee_seq = h.seq;
+		ee_slot = slot + 1;
+		memcpy(&eeprom, &e, sizeof(eeprom));
+	}
+	if (found) {
+		if (ee_slot >= EEPROM_NSLOTS)
+			ee_slot = 0;
+		memcpy(&ee_saved, &eeprom, sizeof(ee_saved));
+		ee_have = 1;
+		return;
+	}
+
+	/* Nothing in the journal, use the old location */
 	dp = (u_char *)&eeprom;
 	for (i = 0, ei = EEPROM_START; i < (int)sizeof(eeprom); ++i, ++ei)
 		*dp++ = EEPROM.read(ei);
+	ee_have = 0;
 }
 
 void
@@ -101,37 +302,36 @@ eeprom_report(void)
 	PRINTF("%5u logseq\n", eeprom.logseq);
 	PRINTF("%5u debug\n", eeprom.debug);
 	PRINTF("%5lu speed\n", eeprom.speed);
+
+	/* Journal */
+	PRINTF("%5u seq (slot %u of %u)\n", ee_seq,
+	    ee_slot == 0 ? EEPROM_NSLOTS - 1 : ee_slot - 1, EEPROM_NSLOTS);
+	PRINTF("%5u errors\n", ee_errors);
+	if (ee_busy || ee_pending)
+		SERIAL_PUTSTR("write in progress\n");
 }
 
+/*
+ * Queue an update if struct eeprom changed; returns 1 if queued,
+ * 0 if there was nothing to do or -1 if the last write failed
+ */
 int8_t
 eeprom_write(boolean verbose)
 {
-	int i, ei;
-	u_char uc, *dp;
-	int8_t didany, error;
-
-	didany = 0;
-	error = 0;
-	dp = (u_char *)&eeprom;
-	for (i = 0, ei = EEPROM_START; i < (int)sizeof(eeprom); ++i, ++ei) {
-		/* Only write when necessary */
-		uc = EEPROM.read(ei);
-		if (uc != *dp) {
-			EEPROM.write(ei, *dp);
-			/* Trust but verify */
-			uc = EEPROM.read(ei);
-			if (uc != *dp)
-				error = 1;
-			didany = 1;
-		}
-		++dp;
-	}
-	if (error) {
+	if (ee_have && memcmp(&ee_saved, &eeprom, sizeof(ee_saved)) == 0)
+		return (ee_failed ? -1 : 0);
+	memcpy(&ee_saved, &eeprom, sizeof(ee_saved));
+	ee_have = 1;
+	if (ee_busy || ee_verify)
+		ee_pending = 1;
+	else
+		ee_start();
+	if (ee_failed) {
 		if (debug || verbose)
 			serial_putstr(FV(msg_eepromfail));
 		return (-1);
 	}
-	if (didany && verbose)
+	if (verbose)
 		SERIAL_PUTSTR("eeprom updated\n");
-	return (didany);
+	return (1);
 }
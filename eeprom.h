@@ -6,15 +6,33 @@ struct eeprom {
 	uint16_t logseq;
 	uint8_t debug;
 	uint32_t speed;
+	/* See config.cpp for these */
+	uint16_t idlems;		/* sync after this much idle time */
+	uint16_t syncms;		/* sync this often while busy */
+	uint16_t rotatekb;		/* start a new log after this much */
+	uint8_t chunk;			/* bytes per file.write() */
+	uint8_t naming;			/* CONFIG_NAME_* */
 };
 
-/* eeprom index to store eeprom struct*/
+/* eeprom index to store eeprom struct (before the journal) */
 #define EEPROM_START	32
 
+/*
+ * Journal: each update goes into the next EEPROM_SLOTSIZE slot
+ * between EEPROM_JOURNAL_START and E2END; the valid record with
+ * the highest sequence number wins at boot
+ */
+#define EEPROM_JOURNAL_START	64
+#define EEPROM_SLOTSIZE		32
+#define EEPROM_NSLOTS \
+    ((uint16_t)((E2END + 1 - EEPROM_JOURNAL_START) / EEPROM_SLOTSIZE))
+#define EEPROM_VERSION		1
+
 extern struct eeprom eeprom;
 
 extern void eeprom_cmd(char *);
 extern void eeprom_init(void);
+extern void eeprom_poll(void);
 extern void eeprom_read(void);
 extern void eeprom_report(void);
 extern int8_t eeprom_write(boolean);
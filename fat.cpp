@@ -0,0 +1,101 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * Free space on the card
+ *
+ * The SD library doesn't keep a free cluster count so a scheduler
+ * task reads the FAT a block at a time and counts the free entries.
+ * The block goes in the console job buffer when there's no job so
+ * the volume's cache (and the log's partial block in it) is left
+ * alone. The total from the last full pass is the answer; a pass
+ * takes a while on a big card but free space doesn't change fast.
+ * The scan starts over each time the card is mounted and stops
+ * while there are card errors.
+ */
+
+#if __has_include("local.h")
+#include "local.h"
+#endif
+
+#include "sdlogger.h"
+
+#include "cmd.h"
+#include "fat.h"
+#include "status.h"
+
+/* Locals */
+static boolean mounted;
+static uint32_t block;			/* next one from the start of the FAT */
+static uint32_t cluster;		/* first entry in it */
+static u_long nfree;			/* so far this pass */
+static u_long freekb = FAT_UNKNOWN;	/* from the last pass */
+
+/* Free space (KB) */
+u_long
+fat_free(void)
+{
+	return (freekb);
+}
+
+/* Scheduler task: count the free clusters in the next FAT block */
+void
+fat_poll(void)
+{
+	uint8_t type;
+	uint16_t i, n;
+	uint32_t last, v;
+
+	if (!STATUS_PRESENT(status)) {
+		mounted = 0;
+		freekb = FAT_UNKNOWN;
+		return;
+	}
+	if (!mounted || cmd_busy() || (status & (STATUS_STATE_ERROR |
+	    STATUS_STATE_RECOVERING | STATUS_STATE_FAILED)) != 0)
+		return;
+	type = volume.fatType();
+	if (type != 16 && type != 32) {
+		mounted = 0;
+		return;
+	}
+
+	if (!card.readBlock(volume.fatStartBlock() + block, cmd_jobbuf)) {
+		/* Start the pass over */
+		block = 0;
+		cluster = 0;
+		nfree = 0;
+		return;
+	}
+
+	/* Entries 0 and 1 are reserved */
+	last = volume.clusterCount() + 2;
+	n = (type == 32) ? 512 / 4 : 512 / 2;
+	for (i = 0; i < n && cluster < last; ++i, ++cluster) {
+		if (cluster < 2)
+			continue;
+		if (type == 32)
+			v = ((const uint32_t *)cmd_jobbuf)[i] & 0x0fffffffUL;
+		else
+			v = ((const uint16_t *)cmd_jobbuf)[i];
+		if (v == 0)
+			++nfree;
+	}
+	++block;
+	if (cluster >= last) {
+		freekb = nfree * volume.blocksPerCluster() / 2;
+		block = 0;
+		cluster = 0;
+		nfree = 0;
+	}
+}
+
+/* Called after the card is mounted */
+void
+fat_reset(void)
+{
+	mounted = 1;
+	block = 0;
+	cluster = 0;
+	nfree = 0;
+	freekb = FAT_UNKNOWN;
+}
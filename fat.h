@@ -0,0 +1,11 @@
+/* @(#) $Id$ (XSE) */
+
+#ifndef _fat_h_
+#define _fat_h_
+/* fat_free() before a scan has finished (or FAT12) */
+#define FAT_UNKNOWN	0xffffffffUL
+
+extern u_long fat_free(void);
+extern void fat_poll(void);
+extern void fat_reset(void);
+#endif
@@ -0,0 +1,235 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * Search a file on the card
+ *
+ * "grep" runs as a console job like cat. Each read fills the shared
+ * job buffer behind the tail of the last line of the previous one
+ * (so a match can't be split between reads) and is searched with
+ * Boyer-Moore-Horspool: the last byte of the window picks how far
+ * to shift, so most bytes are never looked at. A matching line is
+ * shown with the file offset of its start, like "grep -b"; lines
+ * that started too far back to keep are shown from "...".
+ */
+
+#if __has_include("local.h")
+#include "local.h"
+#endif
+
+#include "sdlogger.h"
+
+#include "cmd.h"
+#include "grep.h"
+#include "serial.h"
+#include "sstrings.h"
+
+#if GREP_CARRY < GREP_PATMAX || GREP_CARRY > CMD_JOBBUFSIZE / 2
+#error "GREP_CARRY out of range"
+#endif
+
+/* Locals */
+static SdFile gf;
+static uint8_t pat[GREP_PATMAX];
+static uint8_t patlen;
+static uint8_t skip[256];		/* shift for the window's last byte */
+static uint16_t blen;			/* in cmd_jobbuf[] */
+static u_long boff;			/* file offset of cmd_jobbuf[0] */
+static u_long lineoff;			/* start of the line there */
+static boolean inmatch;			/* showing a line that goes on */
+static uint16_t col;			/* of the line being shown */
+
+/* Forwards */
+static uint16_t grep_match(uint16_t);
+static boolean grep_read(void);
+static void grep_search(uint16_t);
+static void grep_show(uint16_t, uint16_t);
+
+/* "grep pattern file", returns true if the job was started */
+boolean
+grep_cmd(char *s)
+{
+	uint8_t i;
+	char *p;
+
+	while (isblank(*s))
+		++s;
+	p = s;
+	while (*s != '\0' && !isblank(*s))
+		++s;
+	if (s == p || *s == '\0') {
+		serial_putstr(FV(msg_errmsg));
+		return (0);
+	}
+	if (s - p > GREP_PATMAX) {
+		serial_putstr(FV(msg_badvalue));
+		return (0);
+	}
+	patlen = s - p;
+	memcpy(pat, p, patlen);
+	while (isblank(*s))
+		++s;
+
+	gf = SdFile();
+	if (!gf.open(&curdir, s, O_READ)) {
+		PRINTF("Can't open %s\n", s);
+		return (0);
+	}
+	if (gf.isDir() || gf.isSubDir()) {
+		SERIAL_PUTSTR("Can't grep directory\n");
+		gf.close();
+		return (0);
+	}
+
+	memset(skip, patlen, sizeof(skip));
+	for (i = 0; i < patlen - 1; ++i)
+		skip[pat[i]] = patlen - 1 - i;
+	blen = 0;
+	boff = 0;
+	lineoff = 0;
+	inmatch = 0;
+	return (1);
+}
+
+/* Called by cmd_job() when the job is done or interrupted */
+void
+grep_end(void)
+{
+	gf.close();
+}
+
+/* Show the line with a match at i, returns where to search next */
+static uint16_t
+grep_match(uint16_t i)
+{
+	uint16_t j;
+	uint8_t *nl;
+
+	for (j = i; j > 0 && cmd_jobbuf[j - 1] != '\n'; --j)
+		continue;
+	PRINTF("%lu:", j > 0 ? boff + j : lineoff);
+	if (j == 0 && lineoff < boff)
+		SERIAL_PUTSTR("...");
+	col = 0;
+
+	nl = (uint8_t *)memchr(cmd_jobbuf + i, '\n', blen - i);
+	if (nl == NULL) {
+		/* The rest is in the next read */
+		grep_show(j, blen);
+		inmatch = 1;
+		return (blen);
+	}
+	grep_show(j, nl - cmd_jobbuf);
+	serial_nl();
+	return (nl - cmd_jobbuf + 1);
+}
+
+/* Read and search some more, returns 0 when it's done */
+static boolean
+grep_read(void)
+{
+	uint16_t j, keep;
+	int16_t r;
+	uint8_t *nl;
+
+	/* Keep the tail of the last line */
+	keep = 0;
+	if (!inmatch) {
+		for (j = blen; j > 0 && cmd_jobbuf[j - 1] != '\n'; --j)
+			continue;
+		if (j > 0)
+			lineoff = boff + j;
+		keep = blen - j;
+		if (keep > GREP_CARRY)
+			keep = patlen - 1;
+	}
+	memmove(cmd_jobbuf, cmd_jobbuf + blen - keep, keep);
+	boff += blen - keep;
+	blen = keep;
+
+	r = gf.read(cmd_jobbuf + blen, CMD_JOBBUFSIZE - blen);
+	if (r <= 0) {
+		if (inmatch)
+			serial_nl();
+		if (r < 0)
+			SERIAL_PUTSTR("Read error\n");
+		return (0);
+	}
+	blen += r;
+
+	if (!inmatch) {
+		grep_search(0);
+		return (1);
+	}
+
+	/* Finish showing the line */
+	nl = (uint8_t *)memchr(cmd_jobbuf, '\n', blen);
+	if (nl == NULL) {
+		grep_show(0, blen);
+		return (1);
+	}
+	j = nl - cmd_jobbuf;
+	grep_show(0, j);
+	serial_nl();
+	inmatch = 0;
+	lineoff = boff + j + 1;
+	grep_search(j + 1);
+	return (1);
+}
+
+/* Boyer-Moore-Horspool from i to the end of the buffer */
+static void
+grep_search(uint16_t i)
+{
+	uint8_t ch, last;
+
+	last = patlen - 1;
+	while (i + patlen <= blen) {
+		ch = cmd_jobbuf[i + last];
+		if (ch == pat[last] && memcmp(cmd_jobbuf + i, pat, last) == 0) {
+			i = grep_match(i);
+			if (inmatch)
+				return;
+			continue;
+		}
+		i += skip[ch];
+	}
+}
+
+/* Show cmd_jobbuf[i] up to n displaying unprintable (like cat) */
+static void
+grep_show(uint16_t i, uint16_t n)
+{
+	char ch;
+
+	for (; i < n; ++i) {
+		if (col >= GREP_LINEMAX) {
+			if (col == GREP_LINEMAX) {
+				SERIAL_PUTSTR("...");
+				++col;
+			}
+			return;
+		}
+		++col;
+		ch = cmd_jobbuf[i];
+		if (ch == '\r')
+			continue;
+		if (isblank(ch) || isprint(ch))
+			serial_putchar(ch);
+		else
+			PRINTF("\\%03o", (uint8_t)ch);
+	}
+}
+
+/* Search for up to GREP_SLICEMS, returns 0 when the job is done */
+boolean
+grep_slice(void)
+{
+	boolean more;
+	u_long t0;
+
+	t0 = millis();
+	do {
+		more = grep_read();
+	} while (more && MILLIS_SUB(millis(), t0) < GREP_SLICEMS);
+	return (more);
+}
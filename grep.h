@@ -0,0 +1,13 @@
+/* @(#) $Id$ (XSE) */
+
+#ifndef _grep_h_
+#define _grep_h_
+#define GREP_PATMAX	32		/* longest pattern */
+#define GREP_CARRY	128		/* line tail kept between reads */
+#define GREP_LINEMAX	160		/* longest line shown */
+#define GREP_SLICEMS	10		/* searching each slice */
+
+extern boolean grep_cmd(char *);
+extern void grep_end(void);
+extern boolean grep_slice(void);
+#endif
@@ -22,6 +22,8 @@ static const int8_t PROGMEM lederr3state[] = { 2, 4, 2, 4, 2, 26, 0 };
 static const int8_t PROGMEM lederr4state[] = { 2, 4, 2, 4, 2, 4, 2, 20, 0 };
 static const int8_t PROGMEM lederr5state[] =
     { 2, 4, 2, 4, 2, 4, 2, 4, 2, 14, 0 };
+static const int8_t PROGMEM ledrecoverstate[] =
+    { 5, 5, 5, 5, 5, 5, 5, 5, 0 };
 
 static const int8_t *ledp;		/* points to one of the state arrays */
 static int8_t ledn;			/* index into led array */
@@ -57,6 +59,10 @@ led_mode(int8_t mode)
 		ledp = lederr4state;
 		break;
 
+	case LED_MODE_RECOVER:
+		ledp = ledrecoverstate;
+		break;
+
 	case LED_MODE_ERR5:
 	default:
 		ledp = lederr5state;
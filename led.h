@@ -7,6 +7,10 @@
 #define LED_MODE_ERR3	3
 #define LED_MODE_ERR4	4
 #define LED_MODE_ERR5	5
+#define LED_MODE_RECOVER 6		/* even 4 Hz blink */
+
+/* No card, spooling to the RX ring */
+#define LED_MODE_SPOOL	LED_MODE_ERR2
 
 extern void led_green(boolean);
 extern void led_init(void);
@@ -0,0 +1,227 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * CPU time profiler (-DPROF)
+ *
+ * Timer3 runs free at clk/1 and its overflow interrupt extends it to
+ * 32 bits. The main line marks what it's doing with PROF_SET() and
+ * PROF_RESTORE(); each switch charges the cycles since the last one
+ * to the old state less the interrupt time that went by, which the
+ * audit hooks (see audit.h) total per handler. prof_poll() folds
+ * everything into 64 bit totals once a second and prints the
+ * dashboard when it's on.
+ *
+ * Nested interrupts are counted in both handlers.
+ */
+
+#if __has_include("local.h")
+#include "local.h"
+#endif
+
+#include "sdlogger.h"
+
+#include "audit.h"
+#include "prof.h"
+#include "serial.h"
+#include "sstrings.h"
+
+#ifdef PROF
+#define PROF_NSLOTS	(PROF_NSTATES + AUDIT_N)
+
+/* Globals */
+u_long prof_bytes;			/* bytes drained */
+volatile u_long prof_isrcycles;		/* all handlers (wraps) */
+
+/* Locals */
+static const char pn_other[] PROGMEM = "other";
+static const char pn_idle[] PROGMEM = "idle";
+static const char pn_drain[] PROGMEM = "drain";
+static const char pn_sdwrite[] PROGMEM = "sdwrite";
+static const char pn_sdsync[] PROGMEM = "sdsync";
+static const char pn_sdfile[] PROGMEM = "sdfile";
+static const char pn_console[] PROGMEM = "console";
+static const char pn_house[] PROGMEM = "house";
+
+static PGM_P const names[PROF_NSTATES] PROGMEM = {
+	pn_other, pn_idle, pn_drain, pn_sdwrite, pn_sdsync, pn_sdfile,
+	pn_console, pn_house
+};
+
+static volatile uint16_t ovf;		/* Timer3 overflows */
+static uint8_t state;
+static u_long last;			/* prof_now() at the last switch */
+static u_long lastisr;			/* prof_isrcycles then */
+static u_long isrlast[AUDIT_N];		/* audits[].cycles last fold */
+static uint64_t totals[PROF_NSLOTS];	/* states then handlers */
+static uint64_t snap[PROF_NSLOTS];	/* totals at the last report */
+static u_long snapbytes;
+static uint8_t every;			/* dashboard seconds (0 is off) */
+static uint8_t left;			/* seconds until the next one */
+
+/* Forwards */
+static u_long prof_div(uint64_t, uint64_t);
+static void prof_fold(void);
+static u_long prof_now(void);
+static void prof_report(const uint64_t *, u_long);
+
+ISR(TIMER3_OVF_vect)
+{
+	++ovf;
+}
+
+void
+prof_cmd(char *s)
+{
+	long v;
+	char *ep;
+
+	while (isblank(*s))
+		++s;
+	if (strcmp_P(s, PSTR("reset")) == 0) {
+		prof_fold();
+		memset(totals, 0, sizeof(totals));
+		memset(snap, 0, sizeof(snap));
+		prof_bytes = 0;
+		snapbytes = 0;
+		return;
+	}
+	if (*s == '\0') {
+		/* Since the last reset */
+		prof_fold();
+		prof_report(NULL, prof_bytes);
+		return;
+	}
+	v = strtol(s, &ep, 10);
+	if (*ep != '\0' || v < 0 || v > 255) {
+		serial_putstr(FV(msg_errmsg));
+		return;
+	}
+	prof_fold();
+	memcpy(snap, totals, sizeof(snap));
+	snapbytes = prof_bytes;
+	every = v;
+	left = v;
+}
+
+/* a / b without 64 bit division */
+static u_long
+prof_div(uint64_t a, uint64_t b)
+{
+	while ((a >> 32) != 0 || (b >> 32) != 0) {
+		a >>= 1;
+		b >>= 1;
+	}
+	if (b == 0)
+		return (0);
+	return ((u_long)a / (u_long)b);
+}
+
+/* Bring the totals up to date */
+static void
+prof_fold(void)
+{
+	uint8_t i;
+	u_long c;
+
+	(void)prof_set(state);
+	for (i = 0; i < AUDIT_N; ++i) {
+		cli();
+		c = audits[i].cycles;
+		sei();
+		totals[PROF_NSTATES + i] += c - isrlast[i];
+		isrlast[i] = c;
+	}
+}
+
+void
+prof_init(void)
+{
+	/* Timer3: normal mode, clk/1 */
+	TCCR3A = 0;
+	TCCR3B = _BV(CS30);
+	TIMSK3 = _BV(TOIE3);
+	last = prof_now();
+}
+
+static u_long
+prof_now(void)
+{
+	uint8_t s;
+	uint16_t lo, hi;
+
+	s = SREG;
+	cli();
+	lo = TCNT3;
+	hi = ovf;
+	/* Overflowed but the interrupt hasn't run yet */
+	if ((TIFR3 & _BV(TOV3)) != 0 && lo < 0x8000)
+		++hi;
+	SREG = s;
+	return (((u_long)hi << 16) | lo);
+}
+
+/* Scheduler task: fold the totals and print the dashboard */
+void
+prof_poll(void)
+{
+	prof_fold();
+	if (every == 0 || --left > 0)
+		return;
+	left = every;
+	prof_report(snap, prof_bytes - snapbytes);
+	memcpy(snap, totals, sizeof(snap));
+	snapbytes = prof_bytes;
+}
+
+/* Print the totals since base (NULL for all) */
+static void
+prof_report(const uint64_t *base, u_long bytes)
+{
+	uint8_t i;
+	u_long v;
+	PGM_P name;
+	uint64_t d[PROF_NSLOTS], total;
+
+	total = 0;
+	for (i = 0; i < PROF_NSLOTS; ++i) {
+		d[i] = totals[i] - (base != NULL ? base[i] : 0);
+		total += d[i];
+	}
+	for (i = 0; i < PROF_NSLOTS; ++i) {
+		if (d[i] == 0)
+			continue;
+		if (i < PROF_NSTATES)
+			name = (PGM_P)pgm_read_word(&names[i]);
+		else
+			name = (PGM_P)pgm_read_word(
+			    &audit_names[i - PROF_NSTATES]);
+		v = prof_div(d[i] * 1000, total);
+		PRINTF("%-8S %3lu.%lu%%\n", name, v / 10, v % 10);
+	}
+	/* Everything but idle */
+	PRINTF("%lu bytes, %lu cycles/byte\n", bytes,
+	    prof_div(total - d[PROF_IDLE], bytes));
+}
+
+/* Charge the time since the last switch and switch to s */
+uint8_t
+prof_set(uint8_t s)
+{
+	uint8_t old, sreg;
+	u_long now, isr, el, di;
+
+	now = prof_now();
+	sreg = SREG;
+	cli();
+	isr = prof_isrcycles;
+	SREG = sreg;
+	el = now - last;
+	di = isr - lastisr;
+	last = now;
+	lastisr = isr;
+	totals[state] += (el > di) ? el - di : 0;
+	old = state;
+	state = s;
+	return (old);
+}
+#endif
@@ -0,0 +1,33 @@
+/* @(#) $Id$ (XSE) */
+
+#ifndef _prof_h_
+#define _prof_h_
+/* Where the main line is spending its time */
+#define PROF_OTHER	0		/* loop glue */
+#define PROF_IDLE	1		/* asleep in sched_idle() */
+#define PROF_DRAIN	2		/* copying out of the RX ring */
+#define PROF_SDWRITE	3
+#define PROF_SDSYNC	4
+#define PROF_SDFILE	5		/* open and close */
+#define PROF_CONSOLE	6		/* line input and commands */
+#define PROF_HOUSE	7		/* other scheduler tasks */
+#define PROF_NSTATES	8
+
+#ifdef PROF
+/* Account to state s until PROF_RESTORE() */
+#define PROF_SET(s)	uint8_t prof_saved = prof_set(s)
+#define PROF_RESTORE()	(void)prof_set(prof_saved)
+#define PROF_BYTES(n)	prof_bytes += (n)
+
+extern u_long prof_bytes;
+
+extern void prof_cmd(char *);
+extern void prof_init(void);
+extern void prof_poll(void);
+extern uint8_t prof_set(uint8_t);
+#else
+#define PROF_SET(s)
+#define PROF_RESTORE()
+#define PROF_BYTES(n)
+#endif
+#endif
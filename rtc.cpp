@@ -31,35 +31,108 @@
 
 /*
  * Maxim DS3231 I2C real-time clock
+ *
+ * rtc_poll() keeps rtc_time fresh and runs temperature conversions
+ * in the background using queued TWI transactions so nothing on
+ * the capture path (e.g. the SdFat date/time callback) touches the
+ * bus. The blocking rtc_read()/rtc_write() are only used by the
+ * console commands and at boot.
+ *
+ * The 1Hz square wave (SQW) interrupts on each falling edge, which
+ * is when the seconds register increments. rtc_clock() counts
+ * edges from the last query and interpolates within the second
+ * with millis(), all from RAM.
  */
 
 #include <ctype.h>
 
-#include <Wire.h>
-
 #include "sdlogger.h"
 
+#include "audit.h"
 #ifdef HAVE_EEPROM_RTC
 #include "eeprom.h"
 #endif
 #include "rtc.h"
 #include "serial.h"
 #include "sstrings.h"
+#include "twi.h"
 #include "util.h"
 
+/* Query the time this often (ms) */
+#define RTC_QUERY_MS	(60L * 1000L)
+
+/* ...or this often when it's missing or near midnight */
+#define RTC_RETRY_MS	(5L * 1000L)
+#define RTC_MIDNIGHT_MS	1000L
+
+/* Give up waiting for the busy bit after this long (ms) */
+#define RTC_BSY_MS	250L
+
+/* SQW is dead if the last edge is older than this (ms) */
+#define RTC_SQW_MS	1500L
+
+#define RTC_DAYSECS	(24L * 3600L)
+
+/* Temperature conversion states */
+#define RTC_T_IDLE	0		/* nothing going on */
+#define RTC_T_WAIT	1		/* waiting for BSY to clear */
+#define RTC_T_CTRL	2		/* reading the control register */
+#define RTC_T_CONV	3		/* setting CONV */
+#define RTC_T_BUSY	4		/* waiting for the conversion */
+#define RTC_T_READ	5		/* reading the temperature */
+
 /* Globals */
 struct rtc_time rtc_time = {
 	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
 };
+struct rtc_temp rtc_temp;
 extern int8_t mywireaddr;
 
+/* Locals */
+static u_long rtc_lastms;		/* msec when rtc_time was read */
+static u_long rtc_tryms;		/* msec of the last background query */
+static boolean rtc_tried;		/* rtc_tryms is valid */
+static struct twi_xfer rtc_qx;		/* background time query */
+static uint8_t rtc_qreg;
+static struct rtc_time rtc_qbuf;
+static u_long rtc_qticks;		/* rtc_sqwticks when rtc_qx was queued */
+static volatile u_long rtc_qdoneticks;	/* ...and when it finished */
+
+static volatile u_long rtc_sqwticks;	/* SQW falling edges */
+static volatile u_long rtc_sqwms;	/* millis() at the last edge */
+static boolean rtc_sqwon;		/* INT2 enabled */
+static boolean rtc_based;		/* rtc_basesecs is valid */
+static u_long rtc_basesecs;		/* seconds since midnight... */
+static u_long rtc_baseticks;		/* ...at this edge count */
+
+static struct twi_xfer rtc_tx;		/* temperature conversion */
+static uint8_t rtc_tstate;
+static boolean rtc_tprint;		/* report when done */
+static u_long rtc_tms;			/* msec when the state started */
+static uint8_t rtc_twbuf[2];
+static uint8_t rtc_trbuf[2];
+
 /* Forwards */
-static boolean rtc_convert(void);
-static boolean rtc_idle(void);
+static u_long rtc_getticks(void);
+static void rtc_prtemp(struct rtc_temp *);
+static void rtc_qdone(struct twi_xfer *);
 static boolean rtc_read(uint8_t, uint8_t *, int8_t);
 static boolean rtc_read2(uint8_t, uint8_t *, int8_t);
+static void rtc_setbase(struct rtc_time *, u_long);
+static void rtc_sqw(boolean);
+static void rtc_tpoll(void);
+static void rtc_tqueue(uint8_t, uint8_t, int8_t, uint8_t);
 static boolean rtc_write(uint8_t, uint8_t *, int8_t);
 
+ISR(INT2_vect, ISR_NOBLOCK)
+{
+	AUDIT_ENTER_NOBLOCK();
+
+	++rtc_sqwticks;
+	rtc_sqwms = millis();
+	AUDIT_EXIT(AUDIT_SQW);
+}
+
 #ifdef RTC_AGING
 void
 rtc_aging(int8_t offset)
@@ -100,7 +173,6 @@ rtc_cmd(char *s)
 	int8_t v1, v2, v3;
 	struct rtc_time *rt;
 	u_char buf[19];
-	struct rtc_temp temp;
 
 	p = s;
 	if (*p != '\0')
@@ -288,6 +360,8 @@ rtc_cmd(char *s)
 			PRINTF(" %02X", i);
 		serial_nl();
 		PRHEX("rtc: ", buf, sizeof(buf));
+		PRINTF("sqw: %lu ticks%s\n", rtc_getticks(),
+		    rtc_sqwon ? "" : " (disabled)");
 		break;
 
 #ifdef HAVE_EEPROM_RTC
@@ -329,11 +403,8 @@ rtc_cmd(char *s)
 			(void)eeprom_write(1);
 #endif
 
-			/* Force a temperature conversion */
-			if (!rtc_convert()) {
-				serial_putstr(FV(msg_no_rtc));
-				break;
-			}
+			/* Force a temperature conversion (in the background) */
+			(void)rtc_querytemp(0);
 		}
 
 		/* Now report the aging offset */
@@ -362,49 +433,34 @@ rtc_cmd(char *s)
 			serial_putstr(FV(msg_no_rtc));
 			break;
 		}
-		if (ISSET(uch, RTC_C_INTCN)) {
+		/* Stop counting edges while it's not 1Hz */
+		rtc_sqw(0);
+		v1 = uch & (RTC_C_INTCN | RTC_C_RS1 | RTC_C_RS2);
+		uch &= ~(RTC_C_INTCN | RTC_C_RS1 | RTC_C_RS2);
+		if (v1 != CT_8KHZ_CLK) {
 			/* Enable */
-			uch &= ~(RTC_C_INTCN | RTC_C_RS1 | RTC_C_RS2);
 			uch |= CT_8KHZ_CLK;
 		} else {
-			/* Disable */
-			uch |= RTC_C_INTCN;
+			/* Disable (back to 1Hz) */
+			uch |= CT_1HZ_CLK;
 		}
 		(void)rtc_write(RTC_CONTROL, &uch, 1);
 		if (!rtc_read(RTC_CONTROL, &uch, 1)) {
 			serial_putstr(FV(msg_no_rtc));
 			break;
 		}
-		serial_prone(!ISSET(uch, RTC_C_INTCN),
+		v1 = uch & (RTC_C_INTCN | RTC_C_RS1 | RTC_C_RS2);
+		if (v1 == CT_1HZ_CLK)
+			rtc_sqw(1);
+		serial_prone(v1 == CT_8KHZ_CLK,
 		    FV(msg_enabled), FV(msg_disabled));
 		SERIAL_PUTSTR(" 8.192kHz square-wave\n");
 		break;
 
 	case 'T':
-		/* Print the temperature */
-		if (!rtc_querytemp(&temp)) {
-			serial_putstr(FV(msg_no_rtc));
-			return;
-		}
-		PRINTF("0x%02X 0x%02X\n", temp.buf[0], temp.buf[1]);
-		if (temp.negative)
-			serial_putchar('-');
-		PRINTF("%d.%02d C\n", temp.units, temp.hundreths);
-
-		/* Convert to Fahrenheit avoiding floating point */
-		v = temp.units;
-		v *= 100;
-		v += temp.hundreths;
-		if (temp.negative)
-			v = -v;
-		v = ((v * 9) / 5) + (32 * 100);
-		if (v < 0) {
-			v = -v;
-			serial_putchar('-');
-		}
-		units = v / 100;
-		hundreths = v % 100;
-		PRINTF("%d.%02d F\n", units, hundreths);
+		/* Start a conversion, rtc_poll() prints the temperature */
+		if (!rtc_querytemp(1))
+			SERIAL_PUTSTR("conversion in progress\n");
 		break;
 
 	case '?':
@@ -421,7 +477,7 @@ rtc_cmd(char *s)
 		    "'tI%d'\t\tinit aging offset at boot\n"
 #endif
 		    "'tO%d'\t\taging offset\n"
-		    "'tS%d'\t\ttoggle 8.192kHz square wave\n"
+		    "'tS'\t\ttoggle 8.192kHz square wave (instead of 1Hz)\n"
 		    "'tT'\t\tdisplay the temperature\n"
 		    "'th'\t\thelp\n"
 		    );
@@ -433,117 +489,81 @@ rtc_cmd(char *s)
 	}
 }
 
-/* Force a temperature conversion, return 1 if successful */
-static boolean
-rtc_convert(void)
+/*
+ * Seconds and milliseconds since midnight (of the rtc_time date)
+ * without any I2C; returns 0 if we've never heard from the clock
+ */
+boolean
+rtc_clock(u_long *secsp, uint16_t *msp)
 {
-	uint8_t uch;
+	uint8_t s;
+	u_long ticks, edgems, now, secs, ms;
+	struct rtc_time *rt;
 
-	/* Wait until idle */
-	if (!rtc_idle())
+	rt = &rtc_time;
+	if (!RTC_AVAIL(rt))
 		return (0);
 
-	/* Read the control register */
-	if (!rtc_read(RTC_CONTROL, &uch, 1))
-		return (0);
+	s = SREG;
+	cli();
+	ticks = rtc_sqwticks;
+	edgems = rtc_sqwms;
+	SREG = s;
+	now = millis();
+
+	ms = MILLIS_SUB(now, edgems);
+	if (rtc_sqwon && rtc_based && ms < RTC_SQW_MS) {
+		secs = rtc_basesecs + (ticks - rtc_baseticks);
+		if (ms > 999)
+			ms = 999;
+	} else {
+		/* No square wave; extrapolate from the last query */
+		ms = MILLIS_SUB(now, rtc_lastms);
+		secs = RTC2DAYSECS(rt) + (ms / 1000);
+		ms %= 1000;
+	}
 
-	/* Force a temperature conversion */
-	uch |= RTC_C_CONV;
-	if (!rtc_write(RTC_CONTROL, &uch, 1))
-		return (0);
+	/* Don't wrap to the next day, rtc_poll() queries often near midnight */
+	if (secs >= RTC_DAYSECS) {
+		secs = RTC_DAYSECS - 1;
+		ms = 999;
+	}
+	*secsp = secs;
+	if (msp != NULL)
+		*msp = ms;
 	return (1);
 }
 
 #ifdef SdFat_h
-/* SdFat callback */
+/* SdFat callback; no I2C */
 void
 rtc_datetime(uint16_t *datep, uint16_t *timep)
 {
 	uint8_t h, m, s;
-	long delta;
-	boolean doquery;
+	u_long secs;
 	struct rtc_time *rt;
-	static u_long lastmsec = 0;
-
-	/* Try to not hit the clock more than once a minute */
-	doquery = 0;
-	rt = &rtc_time;
-
-	/* First time through */
-	if (lastmsec == 0)
-		doquery = 1;
-
-	/* Missing date */
-	if (!doquery && rt->year == 0xff)
-		doquery = 1;
-
-	/* Avoid wrapping to the next day (last minute of the day) */
-	if (!doquery && RTC2HOUR(rt) == 23 && RTC2MIN(rt) >= 59)
-		doquery = 1;
-
-	/* More than 60 seconds since our last query */
-	if (!doquery) {
-		delta = MILLIS_SUB(msec, lastmsec);
-		if (delta >= 60L * 1000L)
-			doquery = 1;
-	}
 
 	/* Only return the date and time if we got something from the clock */
-	if (doquery) {
-		if (!rtc_query())
-			return;
-		/* Reset lastmsec */
-		lastmsec = msec;
-		delta = 0;
-	}
+	if (!rtc_clock(&secs, NULL))
+		return;
 
-	h = RTC2HOUR(rt);
-	m = RTC2MIN(rt);
-	s = RTC2SEC(rt);
-
-	if (!doquery) {
-		delta /= 1000;
-		s += delta;
-		if (s >= 60) {
-			m += s / 60;
-			s %= 60;
-			if (m >= 60) {
-				h += m / 60;
-				m %= 60;
-			}
-		}
-	}
+	rt = &rtc_time;
+	h = secs / 3600L;
+	m = (secs / 60) % 60;
+	s = secs % 60;
 
 	*datep = FAT_DATE(RTC2YEAR(rt), RTC2MONTH(rt), RTC2DAY(rt));
 	*timep = FAT_TIME(h, m, s);
 }
 #endif
 
-/* Return 1 when idle, 0 if there was an I2C error */
-static boolean
-rtc_idle(void)
-{
-	int16_t i;
-	uint8_t uch;
-
-	/* Wait at least 200ms (temperature conversion time) */
-	for (i = 250; i > 0; --i) {
-		if (!rtc_read(RTC_STATUS, &uch, 1))
-			return (0);
-		if ((uch & RTC_S_BSY) == 0)
-			return (1);
-		delay(1);
-	}
-	return (0);
-}
-
 void
 rtc_init(int8_t addr)
 {
 	uint8_t uch;
 
 	if (mywireaddr == 0) {
-		Wire.begin(addr);
+		twi_init(addr);
 		mywireaddr = addr;
 	} else if (mywireaddr != addr) {
 		PRINTF("rtc_init: invalid addr, aborting (%d != %d)\n",
@@ -551,12 +571,73 @@ rtc_init(int8_t addr)
 		return;
 	}
 
-	/* Disable interrupts */
-	uch = RTC_C_INTCN;
+	/* Disable alarm interrupts, 1Hz square wave */
+	uch = CT_1HZ_CLK;
 	if (!rtc_write(RTC_CONTROL, &uch, 1)) {
 		serial_putstr(FV(msg_no_rtc));
 		return;
 	}
+	rtc_sqw(1);
+}
+
+/* Atomic read of the SQW edge count */
+static u_long
+rtc_getticks(void)
+{
+	uint8_t s;
+	u_long ticks;
+
+	s = SREG;
+	cli();
+	ticks = rtc_sqwticks;
+	SREG = s;
+	return (ticks);
+}
+
+/* Scheduler task: background time queries and temperature conversions */
+void
+rtc_poll(void)
+{
+	u_long interval;
+	struct rtc_time *rt;
+
+	rt = &rtc_time;
+	if (TWI_X_DONE(&rtc_qx)) {
+		if (rtc_qx.state == TWI_X_OK) {
+			memcpy(rt, &rtc_qbuf, sizeof(*rt));
+			rtc_lastms = rtc_tryms;
+
+			/* Ambiguous if an edge arrived while we were busy */
+			if (rtc_qdoneticks == rtc_qticks)
+				rtc_setbase(rt, rtc_qticks);
+			else
+				rtc_tried = 0;
+		}
+		rtc_qx.state = TWI_X_IDLE;
+	}
+	if (rtc_qx.state == TWI_X_IDLE) {
+		if (!RTC_AVAIL(rt))
+			interval = RTC_RETRY_MS;
+		else if (RTC2HOUR(rt) == 23 && RTC2MIN(rt) >= 59)
+			interval = RTC_MIDNIGHT_MS;
+		else
+			interval = RTC_QUERY_MS;
+		if (!rtc_tried || MILLIS_SUB(msec, rtc_tryms) >= interval) {
+			rtc_qreg = RTC_SECS;
+			rtc_qx.addr = TWI_RTC;
+			rtc_qx.wbuf = &rtc_qreg;
+			rtc_qx.wlen = 1;
+			rtc_qx.rbuf = (uint8_t *)&rtc_qbuf;
+			rtc_qx.rlen = sizeof(rtc_qbuf);
+			rtc_qx.done = rtc_qdone;
+			rtc_qticks = rtc_getticks();
+			rtc_tryms = msec;
+			rtc_tried = 1;
+			(void)twi_queue(&rtc_qx);
+		}
+	}
+
+	rtc_tpoll();
 }
 
 boolean
@@ -593,13 +674,49 @@ rtc_prt(void)
 		prts();
 }
 
+static void
+rtc_prtemp(struct rtc_temp *rtp)
+{
+	long v;
+	int16_t units, hundreths;
+
+	PRINTF("0x%02X 0x%02X\n", rtp->buf[0], rtp->buf[1]);
+	if (rtp->negative)
+		serial_putchar('-');
+	PRINTF("%d.%02d C\n", rtp->units, rtp->hundreths);
+
+	/* Convert to Fahrenheit avoiding floating point */
+	v = rtp->units;
+	v *= 100;
+	v += rtp->hundreths;
+	if (rtp->negative)
+		v = -v;
+	v = ((v * 9) / 5) + (32 * 100);
+	if (v < 0) {
+		v = -v;
+		serial_putchar('-');
+	}
+	units = v / 100;
+	hundreths = v % 100;
+	PRINTF("%d.%02d F\n", units, hundreths);
+}
+
+/* Called from the TWI interrupt handler (interrupts on) */
+static void
+rtc_qdone(struct twi_xfer *xp)
+{
+	rtc_qdoneticks = rtc_getticks();
+}
+
 /* Return 1 if we were able to get the time */
 boolean
 rtc_query(void)
 {
+	u_long ticks;
 	struct rtc_time *rt, *rt2, rtc_time2;
 
 	/* Read time */
+	ticks = rtc_getticks();
 	rt2 = &rtc_time2;
 	if (!rtc_read(RTC_SECS, (uint8_t *)rt2, sizeof(*rt2))) {
 		memset(rt2, 0, sizeof(*rt2));
@@ -615,41 +732,25 @@ rtc_query(void)
 	    rt->month != rt2->month ||
 	    rt->day != rt2->day ||
 	    rt->hour != rt2->hour);
+	rtc_lastms = msec;
+	if (rtc_getticks() == ticks)
+		rtc_setbase(rt, ticks);
 
 	return (1);
 }
 
-/* Return 1 if we were able to get the temperature */
+/*
+ * Start a temperature conversion; rtc_poll() updates rtc_temp (and
+ * prints it if asked) when it's done. Returns 0 if one is already
+ * in progress.
+ */
 boolean
-rtc_querytemp(struct rtc_temp *rtp)
+rtc_querytemp(boolean print)
 {
-	uint16_t t;
-
-	/* Force a temperature conversion */
-	if (!rtc_convert())
-		return (0);
-
-	/*
-	 * "A user-initiated temperature conversion does not affect
-	 * the BSY bit for approximately 2ms."
-	 */
-	delay(3);
-
-	/* Wait for the conversion to complete */
-	if (!rtc_idle())
+	if (rtc_tstate != RTC_T_IDLE)
 		return (0);
-
-	/* Read temperature */
-	if (!rtc_read(RTC_TEMPMSB, rtp->buf, sizeof(rtp->buf)))
-		return (0);
-
-	/* Temperature is a 10 bit two's complement value in 0.25 C units */
-	t = (((uint16_t)rtp->buf[0]) << 2) | (rtp->buf[1] >> 6);
-	if ((rtp->buf[0] & RTC_TEMP_SIGN) != 0)
-		t = TWOSCOMPLEMENT(t) & RTC_TEMP_MASK;
-	rtp->units = t >> 2;
-	rtp->hundreths = (t & 0x3) * 25;
-	rtp->negative = ((rtp->buf[0] & RTC_TEMP_SIGN) != 0);
+	rtc_tprint = print;
+	rtc_tqueue(RTC_T_WAIT, RTC_STATUS, 0, 1);
 	return (1);
 }
 
@@ -669,19 +770,15 @@ rtc_read(uint8_t reg, uint8_t *up, int8_t size)
 static boolean
 rtc_read2(uint8_t reg, uint8_t *up, int8_t size)
 {
-	uint8_t cc;
-
-	Wire.beginTransmission(TWI_RTC);
-	Wire.write(reg);
-	Wire.endTransmission();
-
-	cc = Wire.requestFrom(TWI_RTC, size);
-	if (cc != size)
-		return (0);
-
-	while (Wire.available() && size-- > 0)
-		*up++ = Wire.read();
-	return (1);
+	struct twi_xfer x;
+
+	memset(&x, 0, sizeof(x));
+	x.addr = TWI_RTC;
+	x.wbuf = &reg;
+	x.wlen = 1;
+	x.rbuf = up;
+	x.rlen = size;
+	return (twi_sync(&x));
 }
 
 /* Set the time */
@@ -696,6 +793,15 @@ rtc_set(uint8_t hour, uint8_t min, uint8_t sec)
 	return (rtc_write(RTC_SECS, buf, (int8_t)sizeof(buf)));
 }
 
+/* Remember where we were when rtc_time was read */
+static void
+rtc_setbase(struct rtc_time *rt, u_long ticks)
+{
+	rtc_basesecs = RTC2DAYSECS(rt);
+	rtc_baseticks = ticks;
+	rtc_based = 1;
+}
+
 /* Set the date */
 boolean
 rtc_setdate(uint16_t year, uint8_t month, uint8_t day)
@@ -716,6 +822,125 @@ rtc_setdate(uint16_t year, uint8_t month, uint8_t day)
 	return (rtc_write(RTC_DAY, buf, (int8_t)sizeof(buf)));
 }
 
+/* Count 1Hz square wave edges (or not) */
+static void
+rtc_sqw(boolean on)
+{
+	if (on) {
+		pinMode(PIN_RTC_SQW, INPUT_PULLUP);
+		EICRA = (EICRA & ~(_BV(ISC21) | _BV(ISC20))) | _BV(ISC21);
+		EIFR = _BV(INTF2);
+		EIMSK |= _BV(INT2);
+	} else
+		EIMSK &= ~_BV(INT2);
+	rtc_sqwon = on;
+
+	/* The edge count no longer matches rtc_time */
+	rtc_based = 0;
+	rtc_tried = 0;
+}
+
+/* Advance the temperature conversion */
+static void
+rtc_tpoll(void)
+{
+	uint16_t t;
+	struct rtc_temp *rtp;
+
+	if (rtc_tstate == RTC_T_IDLE)
+		return;
+	if (rtc_tx.state == TWI_X_IDLE) {
+		/*
+		 * "A user-initiated temperature conversion does not
+		 * affect the BSY bit for approximately 2ms."
+		 */
+		if (MILLIS_SUB(msec, rtc_tms) >= 3)
+			rtc_tqueue(RTC_T_BUSY, RTC_STATUS, 0, 1);
+		return;
+	}
+	if (!TWI_X_DONE(&rtc_tx))
+		return;
+	if (rtc_tx.state != TWI_X_OK) {
+		if (rtc_tprint)
+			serial_putstr(FV(msg_no_rtc));
+		rtc_tstate = RTC_T_IDLE;
+		return;
+	}
+
+	switch (rtc_tstate) {
+
+	case RTC_T_WAIT:
+	case RTC_T_BUSY:
+		if ((rtc_trbuf[0] & RTC_S_BSY) != 0) {
+			if (MILLIS_SUB(msec, rtc_tms) >= RTC_BSY_MS) {
+				if (rtc_tprint)
+					serial_putstr(FV(msg_no_rtc));
+				rtc_tstate = RTC_T_IDLE;
+				break;
+			}
+			/* Look again */
+			(void)twi_queue(&rtc_tx);
+			break;
+		}
+		if (rtc_tstate == RTC_T_WAIT)
+			rtc_tqueue(RTC_T_CTRL, RTC_CONTROL, 0, 1);
+		else
+			rtc_tqueue(RTC_T_READ, RTC_TEMPMSB, 0,
+			    sizeof(rtc_trbuf));
+		break;
+
+	case RTC_T_CTRL:
+		/* Force a temperature conversion */
+		rtc_twbuf[1] = rtc_trbuf[0] | RTC_C_CONV;
+		rtc_tqueue(RTC_T_CONV, RTC_CONTROL, 1, 0);
+		break;
+
+	case RTC_T_CONV:
+		/* Give the BSY bit time to come up before looking */
+		rtc_tstate = RTC_T_BUSY;
+		rtc_tms = msec;
+		rtc_tx.state = TWI_X_IDLE;
+		break;
+
+	case RTC_T_READ:
+		/* Temperature is a 10 bit two's complement in 0.25 C units */
+		rtp = &rtc_temp;
+		memcpy(rtp->buf, rtc_trbuf, sizeof(rtp->buf));
+		t = (((uint16_t)rtp->buf[0]) << 2) | (rtp->buf[1] >> 6);
+		if ((rtp->buf[0] & RTC_TEMP_SIGN) != 0)
+			t = TWOSCOMPLEMENT(t) & RTC_TEMP_MASK;
+		rtp->units = t >> 2;
+		rtp->hundreths = (t & 0x3) * 25;
+		rtp->negative = ((rtp->buf[0] & RTC_TEMP_SIGN) != 0);
+		rtc_tstate = RTC_T_IDLE;
+		if (rtc_tprint) {
+			rtc_prtemp(rtp);
+			serial_putstr(FV(msg_prompt));
+		}
+		break;
+
+	default:
+		rtc_tstate = RTC_T_IDLE;
+		break;
+	}
+}
+
+/* Enter a temperature conversion state and queue its transaction */
+static void
+rtc_tqueue(uint8_t state, uint8_t reg, int8_t wlen, uint8_t rlen)
+{
+	if (rtc_tstate != state)
+		rtc_tms = msec;
+	rtc_tstate = state;
+	rtc_twbuf[0] = reg;
+	rtc_tx.addr = TWI_RTC;
+	rtc_tx.wbuf = rtc_twbuf;
+	rtc_tx.wlen = 1 + wlen;
+	rtc_tx.rbuf = rtc_trbuf;
+	rtc_tx.rlen = rlen;
+	(void)twi_queue(&rtc_tx);
+}
+
 /* Update the time in certain cases */
 boolean
 rtc_update(uint8_t hour, uint8_t min, uint8_t sec)
@@ -758,11 +983,22 @@ rtc_update(uint8_t hour, uint8_t min, uint8_t sec)
 static boolean
 rtc_write(uint8_t reg, uint8_t *up, int8_t size)
 {
-	Wire.beginTransmission(TWI_RTC);
-	Wire.write(reg);
-	while (size-- > 0)
-		if (!Wire.write(*up++))
-			return (0);
-	Wire.endTransmission();
-	return (1);
+	struct twi_xfer x;
+	uint8_t buf[1 + 7];
+
+	if (size >= (int8_t)sizeof(buf))
+		return (0);
+
+	/* Writing the time restarts the countdown chain */
+	if (reg <= RTC_YEAR) {
+		rtc_based = 0;
+		rtc_tried = 0;
+	}
+	buf[0] = reg;
+	memcpy(buf + 1, up, size);
+	memset(&x, 0, sizeof(x));
+	x.addr = TWI_RTC;
+	x.wbuf = buf;
+	x.wlen = 1 + size;
+	return (twi_sync(&x));
 }
@@ -70,6 +70,8 @@
 #define RTC2HOUR(p) BCD2DEC((p)->hour)
 #define RTC2MIN(p) BCD2DEC((p)->min)
 #define RTC2SEC(p) BCD2DEC((p)->sec)
+#define RTC2DAYSECS(p) \
+    (RTC2SEC(p) + (60L * (RTC2MIN(p) + (60L * RTC2HOUR(p)))))
 
 #define RTC_AVAIL(p) ((p)->year > 0 && (p)->year < 0xff)
 
@@ -93,18 +95,22 @@ struct rtc_temp {
 	u_char buf[2];
 };
 
+extern struct rtc_temp rtc_temp;
+
 #ifdef RTC_AGING
 extern void rtc_aging(int8_t);
 #endif
+extern boolean rtc_clock(u_long *, uint16_t *);
 extern void rtc_cmd(char *);
 #ifdef SdFat_h
 extern void rtc_datetime(uint16_t *, uint16_t *);
 #endif
 extern void rtc_init(int8_t);
+extern void rtc_poll(void);
 extern boolean rtc_pr(void);
 extern void rtc_prt(void);
 extern boolean rtc_query(void);
-extern boolean rtc_querytemp(struct rtc_temp *);
+extern boolean rtc_querytemp(boolean);
 extern boolean rtc_set(uint8_t, uint8_t, uint8_t);
 extern boolean rtc_setdate(uint16_t, uint8_t, uint8_t);
 extern boolean rtc_update(uint8_t, uint8_t, uint8_t);
@@ -0,0 +1,247 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * Cooperative fixed tick scheduler
+ *
+ * Timer2 interrupts SCHED_HZ times a second and bumps sched_ticks.
+ * sched_poll() is called between drain chunks; it returns right
+ * away unless a tick has gone by and then runs at most one due
+ * task so the capture drain gets back in quickly. Housekeeping
+ * that isn't critical is deferred while the RX ring is backing up.
+ *
+ * When there's nothing to do sched_idle() puts the cpu in
+ * SLEEP_MODE_IDLE; the USART RX interrupt or the tick wakes it up.
+ */
+
+#if __has_include("local.h")
+#include "local.h"
+#endif
+
+#include <avr/sleep.h>
+
+#include "sdlogger.h"
+
+#include "audit.h"
+#include "autobaud.h"
+#include "cmd.h"
+#include "eeprom.h"
+#include "fat.h"
+#include "led.h"
+#include "prof.h"
+#include "rtc.h"
+#include "sched.h"
+#include "serial.h"
+#include "sstrings.h"
+#include "stats.h"
+#include "status.h"
+#include "twi.h"
+#include "xfer.h"
+
+#if (F_CPU / 1024 / SCHED_HZ) > 256
+#error "SCHED_HZ too slow for Timer2"
+#endif
+
+struct sched_task {
+	PGM_P name;
+	void (*func)(void);
+	uint8_t period;			/* ticks */
+	uint8_t flags;
+	uint16_t budget;		/* worst case us */
+};
+
+struct sched_stat {
+	uint8_t left;			/* ticks until due */
+	boolean ready;			/* due but not run yet */
+	uint16_t max;			/* longest run (us) */
+	uint16_t over;			/* runs over budget */
+	uint32_t runs;
+	uint32_t total;			/* us */
+};
+
+static const char tn_cd[] PROGMEM = "cd";
+static const char tn_led[] PROGMEM = "led";
+static const char tn_serial[] PROGMEM = "serial";
+static const char tn_cmd[] PROGMEM = "cmd";
+static const char tn_twi[] PROGMEM = "twi";
+static const char tn_rtc[] PROGMEM = "rtc";
+static const char tn_eeprom[] PROGMEM = "eeprom";
+static const char tn_autobaud[] PROGMEM = "autobaud";
+static const char tn_xfer[] PROGMEM = "xfer";
+static const char tn_status[] PROGMEM = "status";
+static const char tn_fat[] PROGMEM = "fat";
+#ifdef PROF
+static const char tn_prof[] PROGMEM = "prof";
+#endif
+
+static const struct sched_task tasks[] PROGMEM = {
+	{ tn_cd, cd_poll, SCHED_TICKS(10), SCHED_F_CRIT, 40 },
+	{ tn_led, led_poll, SCHED_TICKS(25), 0, 40 },
+	{ tn_serial, serial_poll, SCHED_TICKS(5), 0, 200 },
+	{ tn_cmd, cmd_poll, SCHED_TICKS(5), 0, 1000 },
+	{ tn_twi, twi_poll, SCHED_TICKS(10), 0, 40 },
+	{ tn_rtc, rtc_poll, SCHED_TICKS(5), 0, 200 },
+	{ tn_eeprom, eeprom_poll, SCHED_TICKS(20), 0, 200 },
+	{ tn_autobaud, autobaud_poll, SCHED_TICKS(50), 0, 100 },
+	{ tn_xfer, xfer_poll, SCHED_TICKS(100), 0, 200 },
+	{ tn_status, status_poll, SCHED_TICKS(50), 0, 100 },
+	{ tn_fat, fat_poll, SCHED_TICKS(50), 0, 2000 },
+#ifdef PROF
+	{ tn_prof, prof_poll, SCHED_TICKS(1000), 0, 1000 },
+#endif
+};
+#define NTASKS ((uint8_t)(sizeof(tasks) / sizeof(tasks[0])))
+
+/* Globals */
+volatile uint8_t sched_ticks;
+
+/* Locals */
+static struct sched_stat stats[NTASKS];
+static uint8_t lastticks;		/* sched_ticks last time we looked */
+static uint8_t nready;			/* tasks ready to run */
+static uint8_t nexttask;		/* round robin */
+
+ISR(TIMER2_COMPA_vect, ISR_NOBLOCK)
+{
+	AUDIT_ENTER_NOBLOCK();
+
+	++sched_ticks;
+	stats_sample();
+	AUDIT_EXIT(AUDIT_SCHED);
+}
+
+void
+sched_cmd(char *s)
+{
+	uint8_t i;
+	struct sched_task t;
+	struct sched_stat *sp;
+
+	while (isblank(*s))
+		++s;
+	if (strcmp_P(s, PSTR("reset")) == 0) {
+		for (i = 0, sp = stats; i < NTASKS; ++i, ++sp) {
+			sp->max = 0;
+			sp->over = 0;
+			sp->runs = 0;
+			sp->total = 0;
+		}
+		return;
+	}
+	if (*s != '\0') {
+		serial_putstr(FV(msg_errmsg));
+		return;
+	}
+	SERIAL_PUTSTR("task    period budget       runs    max    avg  over\n");
+	for (i = 0, sp = stats; i < NTASKS; ++i, ++sp) {
+		memcpy_P(&t, &tasks[i], sizeof(t));
+		PRINTF("%-7S %4ums %4uus %10lu %5uus %5luus %5u\n",
+		    t.name, t.period * SCHED_MS, t.budget, sp->runs, sp->max,
+		    sp->runs != 0 ? sp->total / sp->runs : 0, sp->over);
+	}
+}
+
+/* Sleep until the next interrupt unless there's work to do */
+void
+sched_idle(void)
+{
+	PROF_SET(PROF_IDLE);
+
+	set_sleep_mode(SLEEP_MODE_IDLE);
+
+	/*
+	 * Check with interrupts off; sleep_cpu() executes before any
+	 * interrupt that arrives after the sei()
+	 */
+	cli();
+	if (nready == 0 && sched_ticks == lastticks &&
+	    NewSerial.available() == 0) {
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+	}
+	sei();
+	PROF_RESTORE();
+}
+
+void
+sched_init(void)
+{
+	uint8_t i;
+
+	/* Timer2: CTC, clk/1024 */
+	TCCR2A = _BV(WGM21);
+	TCCR2B = _BV(CS22) | _BV(CS21) | _BV(CS20);
+	OCR2A = (F_CPU / 1024 / SCHED_HZ) - 1;
+	TIMSK2 = _BV(OCIE2A);
+
+	/* Stagger the first runs */
+	for (i = 0; i < NTASKS; ++i)
+		stats[i].left = i + 1;
+	lastticks = sched_ticks;
+}
+
+/* Run at most one due task */
+void
+sched_poll(void)
+{
+	uint8_t i, n, elapsed;
+	boolean busy;
+	u_long t0, dt;
+	struct sched_task t;
+	struct sched_stat *sp;
+
+	/* Update the ready list once per tick */
+	n = sched_ticks;
+	if (n != lastticks) {
+		elapsed = n - lastticks;
+		lastticks = n;
+		msec = millis();
+		for (i = 0, sp = stats; i < NTASKS; ++i, ++sp) {
+			if (sp->left > elapsed) {
+				sp->left -= elapsed;
+				continue;
+			}
+			sp->left = pgm_read_byte(&tasks[i].period);
+			if (!sp->ready) {
+				sp->ready = 1;
+				++nready;
+			}
+		}
+	}
+	if (nready == 0)
+		return;
+
+	/* The capture drain has priority */
+	busy = (NewSerial.available() >= SCHED_BUSY);
+
+	for (n = 0, i = nexttask; n < NTASKS; ++n, i = (i + 1) % NTASKS) {
+		sp = &stats[i];
+		if (!sp->ready)
+			continue;
+		memcpy_P(&t, &tasks[i], sizeof(t));
+		if (busy && (t.flags & SCHED_F_CRIT) == 0)
+			continue;
+		sp->ready = 0;
+		--nready;
+		nexttask = (i + 1) % NTASKS;
+
+		t0 = micros();
+		{
+			PROF_SET(PROF_HOUSE);
+			(*t.func)();
+			PROF_RESTORE();
+		}
+		dt = micros() - t0;
+
+		++sp->runs;
+		sp->total += dt;
+		if (dt > 0xffff)
+			dt = 0xffff;
+		if (dt > sp->max)
+			sp->max = dt;
+		if (dt > t.budget)
+			++sp->over;
+		return;
+	}
+}
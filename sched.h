@@ -0,0 +1,26 @@
+/* @(#) $Id$ (XSE) */
+
+#ifndef _sched_h_
+#define _sched_h_
+/* Timer2 tick */
+#define SCHED_HZ	200
+#define SCHED_MS	(1000 / SCHED_HZ)
+
+/* Convert ms to ticks (rounding up) */
+#define SCHED_TICKS(ms)	(((ms) + SCHED_MS - 1) / SCHED_MS)
+
+/* Don't run ordinary tasks when this much is waiting in the RX ring */
+#ifndef SCHED_BUSY
+#define SCHED_BUSY	(UART0_RXSIZE / 4)
+#endif
+
+/* Task flags */
+#define SCHED_F_CRIT	0x01		/* runs even when the drain is busy */
+
+extern volatile uint8_t sched_ticks;
+
+extern void sched_cmd(char *);
+extern void sched_idle(void);
+extern void sched_init(void);
+extern void sched_poll(void);
+#endif
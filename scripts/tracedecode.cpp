@@ -0,0 +1,179 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * Decode the sdlogger "trace" console dump into a timeline
+ *
+ *     c++ -O -o tracedecode tracedecode.cpp
+ *     tracedecode [file ...]
+ *
+ * Reads the dump (other console lines are ignored) and prints each
+ * event with its time from the first event and from the previous
+ * one. The timestamps are micros() which wraps every 71 minutes.
+ */
+
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+
+/* Keep in sync with trace.h */
+#define TRACE_RXERR	1
+#define TRACE_HWM	2
+#define TRACE_SYNC	3
+#define TRACE_SYNCDONE	4
+#define TRACE_BUSY	5
+#define TRACE_TWIM	6
+#define TRACE_TWIS	7
+#define TRACE_CD	8
+#define TRACE_CMD	9
+
+/* twi.h */
+#define TWI_X_OK	2
+
+static const char *prog = "tracedecode";
+
+/* Per stream state */
+struct decoder {
+	bool first;
+	uint32_t last;			/* previous timestamp */
+	uint64_t elapsed;		/* since the first event */
+	bool insync;
+	uint64_t syncstart;
+};
+
+static void decode(FILE *, struct decoder *);
+static void event(struct decoder *, uint32_t, unsigned int, unsigned int);
+static void rxerr(unsigned int);
+
+static void
+decode(FILE *f, struct decoder *dp)
+{
+	char line[256];
+	unsigned int id, arg;
+	unsigned long us;
+	char extra;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (line[0] == '#') {
+			fputs(line, stdout);
+			continue;
+		}
+		/* Exactly "tttttttt ii aaaa" */
+		if (sscanf(line, "%8lx %2x %4x %c", &us, &id, &arg,
+		    &extra) != 3)
+			continue;
+		event(dp, (uint32_t)us, id, arg);
+	}
+}
+
+static void
+event(struct decoder *dp, uint32_t us, unsigned int id, unsigned int arg)
+{
+	static const char *ops[] = { "close", "open", "sync", "write" };
+	uint32_t delta;
+
+	if (dp->first) {
+		delta = 0;
+		dp->first = false;
+	} else
+		delta = us - dp->last;
+	dp->last = us;
+	dp->elapsed += delta;
+
+	printf("%6" PRIu64 ".%06" PRIu64 " %+10.3fms  ",
+	    dp->elapsed / 1000000, dp->elapsed % 1000000, delta / 1000.0);
+	switch (id) {
+
+	case TRACE_RXERR:
+		rxerr(arg);
+		break;
+
+	case TRACE_HWM:
+		printf("ring reached %u bytes\n", arg);
+		break;
+
+	case TRACE_SYNC:
+		printf("sync start, ring %u\n", arg);
+		dp->insync = true;
+		dp->syncstart = dp->elapsed;
+		break;
+
+	case TRACE_SYNCDONE:
+		printf("sync done, ring %u", arg);
+		if (dp->insync)
+			printf(" (%.3fms)",
+			    (dp->elapsed - dp->syncstart) / 1000.0);
+		putchar('\n');
+		dp->insync = false;
+		break;
+
+	case TRACE_BUSY:
+		printf("card busy %ums in %s\n", arg & 0x3fff, ops[arg >> 14]);
+		break;
+
+	case TRACE_TWIM:
+		printf("i2c 0x%02x %s\n", arg >> 8,
+		    (arg & 0xff) == TWI_X_OK ? "ok" : "failed");
+		break;
+
+	case TRACE_TWIS:
+		printf("i2c slave received %u bytes\n", arg);
+		break;
+
+	case TRACE_CD:
+		printf("card %s\n", arg ? "inserted" : "removed");
+		break;
+
+	case TRACE_CMD:
+		printf("command \"%c%c...\"\n",
+		    isprint(arg >> 8) ? arg >> 8 : '?',
+		    isprint(arg & 0xff) ? arg & 0xff : ' ');
+		break;
+
+	default:
+		printf("event %u arg 0x%04x\n", id, arg);
+		break;
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	int i, status;
+	FILE *f;
+	struct decoder d;
+
+	status = 0;
+	memset(&d, 0, sizeof(d));
+	d.first = true;
+	if (argc < 2)
+		decode(stdin, &d);
+	for (i = 1; i < argc; ++i) {
+		f = fopen(argv[i], "r");
+		if (f == NULL) {
+			fprintf(stderr, "%s: ", prog);
+			perror(argv[i]);
+			status = 1;
+			continue;
+		}
+		decode(f, &d);
+		fclose(f);
+	}
+	return (status);
+}
+
+/* Names for the error bits (NewSerialPort.h) */
+static void
+rxerr(unsigned int e)
+{
+	fputs("RX error", stdout);
+	if (e & 0x10)
+		fputs(" framing", stdout);
+	if (e & 0x08)
+		fputs(" overrun (DOR)", stdout);
+	if (e & 0x04)
+		fputs(" parity", stdout);
+	if (e & 0x01)
+		fputs(" ring full", stdout);
+	putchar('\n');
+}
@@ -0,0 +1,396 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * Copy files off an sdlogger over its console ("xfer" command)
+ *
+ *     c++ -O -o xfer xfer.cpp
+ *     xfer [-d tty] [-b baud] [-s speed] ls
+ *     xfer [-d tty] [-b baud] [-s speed] get name [file]
+ *
+ * get appends to the local file (default the same name) starting
+ * from its size so an interrupted copy picks up where it stopped.
+ * Frames that fail their CRC or arrive out of order stop the
+ * transfer (^C) and it's asked for again from the last good byte.
+ * With -s the console runs at speed for the transfer and is put
+ * back to baud afterwards.
+ */
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+/* Keep in sync with xfer.h */
+#define XFER_SYNC	0xa5
+#define XFER_DATA	'D'
+#define XFER_NAME	'L'
+#define XFER_END	'E'
+#define XFER_ERR	'!'
+#define XFER_HDRSIZE	7
+#define XFER_MAXDATA	512
+
+#define QUIETMS		300		/* nothing more is coming */
+#define FRAMEMS		5000		/* longest wait for a frame */
+#define RETRIES		10		/* in a row before giving up */
+
+struct frame {
+	int type;
+	uint32_t offset;
+	unsigned int len;
+	uint8_t data[XFER_MAXDATA];
+};
+
+static const char *prog = "xfer";
+static int fd = -1;
+static long baud = 57600;
+
+static int cmd_get(const char *, const char *, long);
+static int cmd_ls(long);
+static uint16_t crc_xmodem(uint16_t, const uint8_t *, size_t);
+static void drain(void);
+static int getframe(struct frame *);
+static int readn(uint8_t *, size_t, int);
+static void sendcmd(const char *);
+static int setbaud(long);
+static int setspeed(long);
+static void usage(void) __attribute__((noreturn));
+
+static int
+cmd_get(const char *name, const char *path, long speed)
+{
+	int lfd, tries, r;
+	off_t off;
+	uint32_t have;
+	char cmd[128];
+	struct frame f;
+
+	lfd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (lfd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", prog, path, strerror(errno));
+		return (1);
+	}
+	off = lseek(lfd, 0, SEEK_END);
+	if (off < 0 || off > (off_t)UINT32_MAX) {
+		fprintf(stderr, "%s: %s: bad size\n", prog, path);
+		close(lfd);
+		return (1);
+	}
+	have = (uint32_t)off;
+	if (have > 0)
+		fprintf(stderr, "%s: resuming %s at %" PRIu32 "\n",
+		    prog, name, have);
+	if (speed != 0 && setspeed(speed) < 0) {
+		close(lfd);
+		return (1);
+	}
+
+	tries = 0;
+	for (;;) {
+		snprintf(cmd, sizeof(cmd), "xfer get %s %" PRIu32, name, have);
+		sendcmd(cmd);
+		while ((r = getframe(&f)) > 0) {
+			if (f.type == XFER_END && f.offset == have) {
+				close(lfd);
+				drain();
+				fprintf(stderr, "%s: %s %" PRIu32 " bytes\n",
+				    prog, name, have);
+				if (speed != 0)
+					(void)setspeed(baud);
+				return (0);
+			}
+			if (f.type != XFER_DATA || f.offset != have)
+				break;
+			if (write(lfd, f.data, f.len) != (ssize_t)f.len) {
+				fprintf(stderr, "%s: %s: %s\n", prog, path,
+				    strerror(errno));
+				close(lfd);
+				return (1);
+			}
+			have += f.len;
+			tries = 0;
+		}
+		if (r == 0)
+			fprintf(stderr, "%s: timeout at %" PRIu32 "\n",
+			    prog, have);
+		else if (r > 0 && f.type == XFER_ERR)
+			fprintf(stderr, "%s: logger read error at %" PRIu32
+			    "\n", prog, have);
+		else
+			fprintf(stderr, "%s: bad frame at %" PRIu32 "\n",
+			    prog, have);
+		if (++tries >= RETRIES) {
+			fprintf(stderr, "%s: giving up\n", prog);
+			close(lfd);
+			return (1);
+		}
+		/* Stop it and ask again */
+		(void)write(fd, "\003", 1);
+		drain();
+	}
+}
+
+static int
+cmd_ls(long speed)
+{
+	int r, tries;
+	struct frame f;
+
+	if (speed != 0 && setspeed(speed) < 0)
+		return (1);
+	for (tries = 0; tries < RETRIES; ++tries) {
+		sendcmd("xfer ls");
+		while ((r = getframe(&f)) > 0 && f.type == XFER_NAME)
+			printf("%-12.*s %10" PRIu32 "\n", (int)f.len,
+			    (const char *)f.data, f.offset);
+		if (r > 0 && f.type == XFER_END) {
+			drain();
+			if (speed != 0)
+				(void)setspeed(baud);
+			return (0);
+		}
+		(void)write(fd, "\003", 1);
+		drain();
+		printf("(retrying)\n");
+	}
+	fprintf(stderr, "%s: giving up\n", prog);
+	return (1);
+}
+
+/* Same as avr-libc _crc_xmodem_update() */
+static uint16_t
+crc_xmodem(uint16_t crc, const uint8_t *p, size_t n)
+{
+	int i;
+
+	while (n-- > 0) {
+		crc ^= (uint16_t)*p++ << 8;
+		for (i = 0; i < 8; ++i)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return (crc);
+}
+
+/* Throw away input until the line goes quiet */
+static void
+drain(void)
+{
+	uint8_t buf[256];
+
+	while (readn(buf, 1, QUIETMS) > 0)
+		(void)read(fd, buf, sizeof(buf));
+	tcflush(fd, TCIFLUSH);
+}
+
+/* Returns 1 for a good frame, 0 on timeout and -1 for a bad one */
+static int
+getframe(struct frame *fp)
+{
+	uint8_t b, hdr[XFER_HDRSIZE], tr[2];
+	uint16_t crc;
+
+	/* Skip the command echo and anything else that isn't a frame */
+	do {
+		if (readn(&b, 1, FRAMEMS) <= 0)
+			return (0);
+	} while (b != XFER_SYNC);
+
+	if (readn(hdr, sizeof(hdr), FRAMEMS) <= 0)
+		return (0);
+	fp->type = hdr[0];
+	fp->offset = (uint32_t)hdr[1] | (uint32_t)hdr[2] << 8 |
+	    (uint32_t)hdr[3] << 16 | (uint32_t)hdr[4] << 24;
+	fp->len = hdr[5] | hdr[6] << 8;
+	if (fp->len > XFER_MAXDATA)
+		return (-1);
+	if (readn(fp->data, fp->len, FRAMEMS) <= 0 ||
+	    readn(tr, sizeof(tr), FRAMEMS) <= 0)
+		return (0);
+	crc = crc_xmodem(0, hdr, sizeof(hdr));
+	crc = crc_xmodem(crc, fp->data, fp->len);
+	if (crc != ((tr[0] << 8) | tr[1]))
+		return (-1);
+	return (1);
+}
+
+int
+main(int argc, char **argv)
+{
+	int op;
+	long speed;
+	const char *dev;
+	char *ep;
+	struct termios t;
+
+	dev = getenv("SDLOGGER");
+	if (dev == NULL)
+		dev = "/dev/ttyUSB0";
+	speed = 0;
+	while ((op = getopt(argc, argv, "b:d:s:")) != -1) {
+		switch (op) {
+
+		case 'b':
+			baud = strtol(optarg, &ep, 10);
+			if (*ep != '\0' || baud <= 0)
+				usage();
+			break;
+
+		case 'd':
+			dev = optarg;
+			break;
+
+		case 's':
+			speed = strtol(optarg, &ep, 10);
+			if (*ep != '\0' || speed <= 0)
+				usage();
+			break;
+
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+		usage();
+
+	fd = open(dev, O_RDWR | O_NOCTTY);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: %s\n", prog, dev, strerror(errno));
+		return (1);
+	}
+	if (tcgetattr(fd, &t) < 0) {
+		fprintf(stderr, "%s: %s: %s\n", prog, dev, strerror(errno));
+		return (1);
+	}
+	cfmakeraw(&t);
+	t.c_cflag |= CLOCAL | CREAD;
+	t.c_cflag &= ~CRTSCTS;
+	t.c_cc[VMIN] = 0;
+	t.c_cc[VTIME] = 0;
+	if (tcsetattr(fd, TCSANOW, &t) < 0 || setbaud(baud) < 0) {
+		fprintf(stderr, "%s: %s: %s\n", prog, dev, strerror(errno));
+		return (1);
+	}
+	if (speed == baud)
+		speed = 0;
+
+	/* Stop anything that's running */
+	(void)write(fd, "\003\r", 2);
+	drain();
+
+	if (strcmp(argv[0], "ls") == 0 && argc == 1)
+		return (cmd_ls(speed));
+	if (strcmp(argv[0], "get") == 0 && (argc == 2 || argc == 3))
+		return (cmd_get(argv[1], argc == 3 ? argv[2] : argv[1],
+		    speed));
+	usage();
+}
+
+/* Returns 1 when n bytes have been read, 0 on timeout, -1 on error */
+static int
+readn(uint8_t *buf, size_t n, int ms)
+{
+	ssize_t r;
+	struct pollfd pfd;
+
+	while (n > 0) {
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		r = poll(&pfd, 1, ms);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return (r);
+		r = read(fd, buf, n);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return (-1);
+		buf += r;
+		n -= r;
+	}
+	return (1);
+}
+
+static void
+sendcmd(const char *cmd)
+{
+	(void)write(fd, cmd, strlen(cmd));
+	(void)write(fd, "\r", 1);
+}
+
+static int
+setbaud(long b)
+{
+	speed_t s;
+	struct termios t;
+
+	switch (b) {
+
+	case 9600:	s = B9600; break;
+	case 19200:	s = B19200; break;
+	case 38400:	s = B38400; break;
+	case 57600:	s = B57600; break;
+	case 115200:	s = B115200; break;
+	case 230400:	s = B230400; break;
+#ifdef B460800
+	case 460800:	s = B460800; break;
+#endif
+#ifdef B921600
+	case 921600:	s = B921600; break;
+#endif
+	default:
+		fprintf(stderr, "%s: %ld baud not supported\n", prog, b);
+		return (-1);
+	}
+	if (tcgetattr(fd, &t) < 0)
+		return (-1);
+	cfsetispeed(&t, s);
+	cfsetospeed(&t, s);
+	return (tcsetattr(fd, TCSADRAIN, &t));
+}
+
+/* Switch the logger's console and then ours; the prompt confirms it */
+static int
+setspeed(long b)
+{
+	uint8_t ch, last;
+	char cmd[32];
+
+	snprintf(cmd, sizeof(cmd), "xfer speed %ld", b == baud ? 0 : b);
+	sendcmd(cmd);
+	/* "ok" goes out at the old speed */
+	last = 0;
+	while (readn(&ch, 1, FRAMEMS) > 0) {
+		if (last == 'o' && ch == 'k')
+			break;
+		last = ch;
+	}
+	usleep(100000);
+	if (setbaud(b) < 0)
+		return (-1);
+	drain();
+	sendcmd("");
+	while (readn(&ch, 1, FRAMEMS) > 0)
+		if (ch == '>') {
+			drain();
+			return (0);
+		}
+	fprintf(stderr, "%s: no prompt at %ld baud\n", prog, b);
+	return (-1);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-d tty] [-b baud] [-s speed] ls\n", prog);
+	fprintf(stderr, "       %s [-d tty] [-b baud] [-s speed] get name "
+	    "[file]\n", prog);
+	exit(1);
+}
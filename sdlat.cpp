@@ -0,0 +1,194 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * SD card latency
+ *
+ * The logger's file operations go through these wrappers, which
+ * time them with micros() into log2 histograms per operation and
+ * keep the SDLAT_NWORST slowest with when (ms since boot) and where
+ * (file offset) they happened. Block reads and writes and the busy
+ * waits are inside the SD library so they're counted as part of the
+ * file operation that caused them.
+ */
+
+#if __has_include("local.h")
+#include "local.h"
+#endif
+
+#include "sdlogger.h"
+
+#include "prof.h"
+#include "sdlat.h"
+#include "serial.h"
+#include "sstrings.h"
+#include "trace.h"
+
+struct sdlat_event {
+	u_long us;
+	u_long ms;			/* millis() when it started */
+	u_long offset;			/* file position before */
+	uint8_t op;
+};
+
+/* Locals */
+static uint32_t hist[SDLAT_NOPS][SDLAT_NBUCKETS];
+static struct sdlat_event worst[SDLAT_NWORST];	/* slowest first */
+static u_long writemax;				/* longest write or sync */
+
+static const char on_close[] PROGMEM = "close";
+static const char on_open[] PROGMEM = "open";
+static const char on_sync[] PROGMEM = "sync";
+static const char on_write[] PROGMEM = "write";
+
+static PGM_P const opnames[SDLAT_NOPS] PROGMEM = {
+	on_close, on_open, on_sync, on_write
+};
+
+/* Forwards */
+static void sdlat_record(uint8_t, u_long, u_long, u_long);
+
+uint8_t
+sdlat_close(SdFile *fp)
+{
+	uint8_t ret;
+	u_long offset, ms, t0;
+	PROF_SET(PROF_SDFILE);
+
+	offset = fp->curPosition();
+	ms = millis();
+	t0 = micros();
+	ret = fp->close();
+	PROF_RESTORE();
+	sdlat_record(SDLAT_CLOSE, t0, ms, offset);
+	return (ret);
+}
+
+void
+sdlat_cmd(char *s)
+{
+	uint8_t i, op;
+	u_long lo;
+	struct sdlat_event *ep;
+
+	while (isblank(*s))
+		++s;
+	if (strcmp_P(s, PSTR("reset")) == 0) {
+		memset(hist, 0, sizeof(hist));
+		memset(worst, 0, sizeof(worst));
+		writemax = 0;
+		return;
+	}
+	if (*s != '\0') {
+		serial_putstr(FV(msg_errmsg));
+		return;
+	}
+
+	SERIAL_PUTSTR("us           close      open      sync     write\n");
+	for (i = 0; i < SDLAT_NBUCKETS; ++i) {
+		lo = (i == 0) ? 0 : (1UL << (SDLAT_MINSHIFT + i - 1));
+		PRINTF("%7lu%c", lo, (i == SDLAT_NBUCKETS - 1) ? '+' : ' ');
+		for (op = 0; op < SDLAT_NOPS; ++op)
+			PRINTF(" %9lu", hist[op][i]);
+		serial_nl();
+	}
+
+	SERIAL_PUTSTR("worst:\n");
+	for (i = 0, ep = worst; i < SDLAT_NWORST; ++i, ++ep) {
+		if (ep->us == 0)
+			break;
+		PRINTF("%-5S %8luus at %lu.%03lus offset %lu\n",
+		    (PGM_P)pgm_read_word(&opnames[ep->op]), ep->us,
+		    ep->ms / 1000, ep->ms % 1000, ep->offset);
+	}
+}
+
+uint8_t
+sdlat_open(SdFile *fp, SdFile *dir, const char *name, uint8_t flags)
+{
+	uint8_t ret;
+	u_long ms, t0;
+	PROF_SET(PROF_SDFILE);
+
+	ms = millis();
+	t0 = micros();
+	ret = fp->open(dir, name, flags);
+	PROF_RESTORE();
+	sdlat_record(SDLAT_OPEN, t0, ms, 0);
+	return (ret);
+}
+
+static void
+sdlat_record(uint8_t op, u_long t0, u_long ms, u_long offset)
+{
+	uint8_t i;
+	u_long us, v;
+	struct sdlat_event *ep;
+
+	us = micros() - t0;
+	if (us >= TRACE_BUSYUS)
+		trace(TRACE_BUSY, ((uint16_t)op << 14) |
+		    (uint16_t)min(us / 1000, 0x3fffUL));
+
+	if ((op == SDLAT_WRITE || op == SDLAT_SYNC) && us > writemax)
+		writemax = us;
+
+	/* Bucket */
+	v = us >> SDLAT_MINSHIFT;
+	for (i = 0; v != 0 && i < SDLAT_NBUCKETS - 1; ++i)
+		v >>= 1;
+	++hist[op][i];
+
+	/* Insert into the worst list (slowest first) */
+	for (i = 0; i < SDLAT_NWORST && us <= worst[i].us; ++i)
+		continue;
+	if (i >= SDLAT_NWORST)
+		return;
+	memmove(&worst[i + 1], &worst[i],
+	    (SDLAT_NWORST - 1 - i) * sizeof(worst[0]));
+	ep = &worst[i];
+	ep->us = us;
+	ep->ms = ms;
+	ep->offset = offset;
+	ep->op = op;
+}
+
+uint8_t
+sdlat_sync(SdFile *fp)
+{
+	uint8_t ret;
+	u_long offset, ms, t0;
+	PROF_SET(PROF_SDSYNC);
+
+	offset = fp->curPosition();
+	ms = millis();
+	trace(TRACE_SYNC, NewSerial.available());
+	t0 = micros();
+	ret = fp->sync();
+	PROF_RESTORE();
+	sdlat_record(SDLAT_SYNC, t0, ms, offset);
+	trace(TRACE_SYNCDONE, NewSerial.available());
+	return (ret);
+}
+
+size_t
+sdlat_write(SdFile *fp, const void *buf, uint16_t n)
+{
+	size_t ret;
+	u_long offset, ms, t0;
+	PROF_SET(PROF_SDWRITE);
+
+	offset = fp->curPosition();
+	ms = millis();
+	t0 = micros();
+	ret = fp->write(buf, n);
+	PROF_RESTORE();
+	sdlat_record(SDLAT_WRITE, t0, ms, offset);
+	return (ret);
+}
+
+/* Longest write or sync (us) since the last reset */
+u_long
+sdlat_writemax(void)
+{
+	return (writemax);
+}
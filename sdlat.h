@@ -0,0 +1,27 @@
+/* @(#) $Id$ (XSE) */
+
+#ifndef _sdlat_h_
+#define _sdlat_h_
+/* Operations */
+#define SDLAT_CLOSE	0
+#define SDLAT_OPEN	1
+#define SDLAT_SYNC	2
+#define SDLAT_WRITE	3
+#define SDLAT_NOPS	4
+
+/* log2 us buckets: <128, 128-255, ... (the last one catches the rest) */
+#define SDLAT_MINSHIFT	7
+#define SDLAT_NBUCKETS	14
+
+/* Worst events kept */
+#ifndef SDLAT_NWORST
+#define SDLAT_NWORST	8
+#endif
+
+extern uint8_t sdlat_close(SdFile *);
+extern void sdlat_cmd(char *);
+extern uint8_t sdlat_open(SdFile *, SdFile *, const char *, uint8_t);
+extern uint8_t sdlat_sync(SdFile *);
+extern size_t sdlat_write(SdFile *, const void *, uint16_t);
+extern u_long sdlat_writemax(void);
+#endif
@@ -7,30 +7,61 @@
 #include <NewSerialPort.h>
 
 #include <avr/pgmspace.h>
-#ifdef notdef
-#include <avr/power.h>
-#include <avr/sleep.h>
-#endif
 #include <avr/wdt.h>
 
 #include "sdlogger.h"
 
+#include "audit.h"
+#include "autobaud.h"
 #include "cmd.h"
+#include "config.h"
 #include "eeprom.h"
+#include "fat.h"
 #include "led.h"
+#include "prof.h"
 #include "rtc.h"
+#include "sched.h"
+#include "sdlat.h"
 #include "serial.h"
 #include "sstrings.h"
+#include "stats.h"
 #include "status.h"
+#include "tail.h"
+#include "trace.h"
+#include "trigger.h"
 #include "util.h"
 
-NewSerialPort<0, UART0_SIZE, 0> NewSerial;
+NewSerialPort<0, UART0_RXSIZE, 0> NewSerial;
+
+/*
+ * Capture RX; TX isn't buffered so there's no UDRE handler. It makes
+ * no calls (avr-gcc would save every call clobbered register for each
+ * byte); the tick traces the error bits NewSerial keeps.
+ */
+ISR(SERIAL_RX0_vect)
+{
+	uint8_t e;
+	AUDIT_ENTER();
+
+	e = NewSerial.rxIsr();
+	if (e != 0)
+		STATS_RXERR(e);
+	AUDIT_EXIT(AUDIT_RX0);
+}
 
 /* Blinking LED error codes */
 #define ERROR_SD_INIT	LED_MODE_ERR3
 #define ERROR_SD_WRITE	LED_MODE_ERR4
 #define ERROR_SD_OPEN	LED_MODE_ERR5
 
+/* Recovery: retry after RECOVER_MS, doubling each time, RECOVER_TRIES times */
+#ifndef RECOVER_TRIES
+#define RECOVER_TRIES	8
+#endif
+#define RECOVER_MS	250L
+/* After that we're "failed" but keep trying this often */
+#define RECOVER_FAILED_MS (RECOVER_MS << RECOVER_TRIES)
+
 /* Globals */
 uint8_t debug;
 SdFile curdir;
@@ -41,33 +72,64 @@ u_long msec;
 u_long card_present_lastms;
 int8_t mywireaddr;
 
+/* Locals */
+static uint8_t localBuffer[CONFIG_CHUNK_MAX]; /* chunk being written */
+static uint8_t localCount;		/* bytes in localBuffer */
+static u_long lostbytes;		/* RX bytes lost as of last report */
+static uint8_t recover_tries;		/* attempts since the last good write */
+static boolean splitting;		/* new log after splitleft bytes */
+static u_long splitleft;
+static boolean capturing;		/* append_file() is in loop() */
+static boolean drainerr;		/* capture_yield() failed to write */
+static boolean dirty;			/* written since the last sync */
+static u_long lastdata;			/* msec of the last write */
+static u_long written;			/* to the current log */
+static u_long received;			/* taken from the RX ring (rxPosition()) */
+static u_long logged;			/* written to all logs since boot */
+static u_long lastsync;			/* msec of the last sync */
+static const char *logname;		/* the current log */
+static boolean paused;			/* capture is being dropped */
+static struct status_cmd hcmd;		/* host command waiting to run */
+static boolean cmdpending;		/* ...after cmdleft more bytes */
+static u_long cmdleft;
+
 /* Forwards */
-void append_file(char *);
-void blink_error(uint8_t);
+uint8_t append_file(char *);
+void capture_begin(uint32_t);
+void capture_speed(uint32_t);
+void capture_status(struct status_log *);
+void capture_yield(void);
+void cd_poll(void);
 void error(const char *);
-void datelog(void);
+boolean datelog(char *, size_t);
+int16_t drain(void);
+int8_t hostcmd(const struct status_cmd *);
 void loop(void);
-void newlog(void);
-void seqlog(void);
+boolean mount(void);
+boolean newlog(char *, size_t);
+boolean openlog(char *, size_t);
+boolean seqlog(char *, size_t);
+void recover(uint8_t);
+void recovered(void);
+boolean rotatable(void);
 void setup(void);
+void spoolreport(void);
 
 void
 error(const char *str)
 {
-	PRINTF("error: %s\n", str);
+	DPRINTF("error: %s\n", str);
 	if (card.errorCode())
-		PRINTF("SD error: 0x%x 0x%x\n",
+		DPRINTF("SD error: 0x%x 0x%x\n",
 		    card.errorCode(), card.errorData());
-
-	led_mode(ERROR_SD_OPEN);
-	for (;;)
-		loop();
 }
 
 void
 setup(void)
 {
+	uint8_t e;
 	char buf[32];
+	char fn[32];
 
 	/* Grab and then zero the MCU status register */
 	boot_mcusr = MCUSR;
@@ -78,15 +140,28 @@ setup(void)
 
 	/* Setup UART1 (configuration/debugging) */
 	serial_init(UART1_BAUD);
+	serial_onyield(capture_yield);
 
 	/* Initial time */
 	msec = millis();
 
+	/* Start the housekeeping tick */
+	sched_init();
+#ifdef ISR_AUDIT
+	audit_init();
+#endif
+#ifdef PROF
+	prof_init();
+#endif
+
 	/* Read eeprom, set defaults */
 	eeprom_init();
 
 	/* Setup UART0 */
-	NewSerial.begin(eeprom.speed);
+	if (eeprom.speed == 0)
+		autobaud_start();
+	else
+		capture_begin(eeprom.speed);
 
 	/* SD card detect (internal pullup) */
 	pinMode(PIN_SD_CD, INPUT);
@@ -112,108 +187,309 @@ setup(void)
 	/* I2C status */
 	status_init();
 
-	/* Real time clock */
+	/* Real time clock; blocking is fine at boot, rtc_poll() keeps it */
 	rtc_init(TWI_SDLOGGER);
+	(void)rtc_query();
 
 	/* Register SD date/time callback */
 	cmd_init();
 
-	/* Setup SD & FAT */
-	if (!card.init(SPI_FULL_SPEED)) {
-		SERIAL_PUTSTR("error card.init\n");
-		blink_error(ERROR_SD_INIT);
-	}
-	if (!volume.init(&card)) {
-		SERIAL_PUTSTR("error volume.init\n");
-		blink_error(ERROR_SD_INIT);
-	}
-	if (!curdir.openRoot(&volume)) {
-		SERIAL_PUTSTR("error openRoot\n");
-		blink_error(ERROR_SD_INIT);
+	/*
+	 * Capture forever. When there's no card the RX ring spools
+	 * the incoming data; each time a card shows up it gets
+	 * mounted and the spool is written to a new log. After an
+	 * error the card, volume and file are brought back up (the
+	 * same log is appended to) with exponential backoff while
+	 * the RX ring keeps spooling.
+	 */
+	fn[0] = '\0';
+	for (;;) {
+		if (!STATUS_PRESENT(status) || !CARD_PRESENT()) {
+			/* A new card starts fresh */
+			fn[0] = '\0';
+			recover_tries = 0;
+			status_set(0, STATUS_STATE_RECOVERING |
+			    STATUS_STATE_FAILED);
+			led_mode(LED_MODE_SPOOL);
+			while (!STATUS_PRESENT(status) || !CARD_PRESENT()) {
+				led_red(localCount > 0 ||
+				    NewSerial.available() > 0);
+				loop();
+			}
+			led_mode(LED_MODE_RUN);
+		}
+
+		/* Setup SD & FAT */
+		if (!mount()) {
+			recover(ERROR_SD_INIT);
+			continue;
+		}
+
+		if (fn[0] == '\0' && !openlog(fn, sizeof(fn))) {
+			/* All opens failed */
+			fn[0] = '\0';
+			recover(ERROR_SD_OPEN);
+			continue;
+		}
+		spoolreport();
+		e = append_file(fn);
+		if (e != 0)
+			recover(e);
 	}
+}
 
-	/* First try for date/time file (call rtc_query() twice) */
-	if (rtc_query() && rtc_query())
-		datelog();
+/* Housekeeping, called between drain chunks */
+void
+loop(void)
+{
+	sched_poll();
+}
 
-	/* Next try a numbered log */
-	newlog();
+/* Start UART0 using the divisor from the baud table */
+void
+capture_begin(uint32_t speed)
+{
+	uint16_t ubrr;
+	boolean u2x;
 
-	/* Finally try a sequential log */
-	seqlog();
+	if (serial_divisor(speed, &ubrr, &u2x))
+		NewSerial.beginUbrr(ubrr, u2x);
+	else
+		NewSerial.begin(speed);
+}
 
-	/* We should never get this far (all opens failed) */
-	led_mode(ERROR_SD_OPEN);
-	for (;;)
-		loop();
+/*
+ * Change the capture speed (0 for auto-baud) on the fly. What's
+ * already been received goes to the current log and the rest to
+ * a new one.
+ */
+void
+capture_speed(uint32_t speed)
+{
+	uint8_t s;
+
+	if (speed == 0)
+		autobaud_start();
+	else if (autobaud_active())
+		autobaud_stop();
+	s = SREG;
+	cli();
+	if (speed != 0)
+		capture_begin(speed);
+	splitleft = NewSerial.available() + localCount;
+	splitting = 1;
+	SREG = s;
 }
 
+/* For the I2C status map (status_poll()) */
 void
-loop(void)
+capture_status(struct status_log *lp)
 {
-	boolean present;
+	lp->captured = received + NewSerial.available();
+	lp->written = logged;
+	/* Only while append_file() has the log open */
+	if (capturing) {
+		lp->size = file.fileSize();
+		lp->lastsync = lastsync;
+		strncpy(lp->name, logname, sizeof(lp->name) - 1);
+		lp->name[sizeof(lp->name) - 1] = '\0';
+	} else {
+		lp->size = 0;
+		lp->lastsync = 0;
+		lp->name[0] = '\0';
+	}
+}
 
-	/* Time */
-	msec = millis();
+/* Keep writing the log while console output waits (serial_onyield()) */
+void
+capture_yield(void)
+{
+	if (!capturing || drainerr || !STATUS_PRESENT(status))
+		return;
+	if (drain() < 0)
+		drainerr = 1;
+}
 
-	/* LED */
-	led_poll();
+/* Card detect (scheduler task) */
+void
+cd_poll(void)
+{
+	boolean present;
 
-	/* Card detect */
 	present = STATUS_PRESENT(status);
 	if (present != CARD_PRESENT()) {
 		if (MILLIS_SUB(msec, card_present_lastms) >= PRESS_MS) {
 			present = !present;
-			SERIAL_PUTSTR("card ");
 			if (present)
-				SERIAL_PUTSTR("inserted");
+				DPUTSTR("card inserted\n");
 			else
-				SERIAL_PUTSTR("removed");
-			serial_nl();
+				DPUTSTR("card removed\n");
 			status_set(present, STATUS_STATE_PRESENT);
+			trace(TRACE_CD, present);
 			card_present_lastms = msec;
 		}
 	}
+}
+
+/* (Re)initialize the card, volume and root directory */
+boolean
+mount(void)
+{
+	/* Forget anything that was open on the last card */
+	file = SdFile();
+	curdir = SdFile();
+
+	if (!card.init(SPI_FULL_SPEED)) {
+		DPUTSTR("error card.init\n");
+		return (0);
+	}
+	if (!volume.init(&card)) {
+		DPUTSTR("error volume.init\n");
+		return (0);
+	}
+	if (!curdir.openRoot(&volume)) {
+		DPUTSTR("error openRoot\n");
+		return (0);
+	}
+	fat_reset();
+	return (1);
+}
 
-	/* Serial port and commands */
-	serial_poll();
-	cmd_poll();
+/* Create a new log file, return 1 with its name in fn on success */
+boolean
+openlog(char *fn, size_t size)
+{
+	switch (eeprom.naming) {
+
+	case CONFIG_NAME_DATE:
+		return (datelog(fn, size));
+
+	case CONFIG_NAME_NEW:
+		return (newlog(fn, size));
+
+	case CONFIG_NAME_SEQ:
+		return (seqlog(fn, size));
+
+	default:
+		break;
+	}
+
+	/* First try for date/time file */
+	if (datelog(fn, size))
+		return (1);
+
+	/* Next try a numbered log */
+	if (newlog(fn, size))
+		return (1);
+
+	/* Finally try a sequential log */
+	return (seqlog(fn, size));
+}
+
+/*
+ * Wait before the next attempt to bring the card back up. The first
+ * RECOVER_TRIES waits double each time; after that we report failed
+ * but keep trying every RECOVER_FAILED_MS. Swapping the card ends
+ * the wait early.
+ */
+void
+recover(uint8_t e)
+{
+	u_long t0, backoff;
+
+	status_set(1, STATUS_STATE_ERROR);
+	if (recover_tries < RECOVER_TRIES) {
+		backoff = RECOVER_MS << recover_tries;
+		++recover_tries;
+		DPRINTF("recovering (%d/%d), retry in %lu ms\n",
+		    recover_tries, RECOVER_TRIES, backoff);
+		status_set(1, STATUS_STATE_RECOVERING);
+		led_mode(LED_MODE_RECOVER);
+	} else {
+		backoff = RECOVER_FAILED_MS;
+		if (!STATUS_FAILED(status)) {
+			DPRINTF("recovery failed (%d), retry every %lu ms\n",
+			    e, backoff);
+			status_set(0, STATUS_STATE_RECOVERING);
+			status_set(1, STATUS_STATE_FAILED);
+			led_mode(e);
+		}
+	}
+
+	t0 = msec;
+	while (MILLIS_SUB(msec, t0) < backoff && STATUS_PRESENT(status)) {
+		led_red(localCount > 0 || NewSerial.available() > 0);
+		loop();
+	}
+}
+
+/* Data is reaching the card again */
+void
+recovered(void)
+{
+	if (recover_tries == 0 && !STATUS_FAILED(status))
+		return;
+	DPUTSTR("recovered\n");
+	recover_tries = 0;
+	status_set(0, STATUS_STATE_RECOVERING | STATUS_STATE_FAILED);
+	led_mode(LED_MODE_RUN);
+}
+
+/* Report what piled up in the RX ring while there was no card */
+void
+spoolreport(void)
+{
+	u_long lost;
+
+	lost = NewSerial.getRxLost();
+	if (lost != lostbytes)
+		DPRINTF("spooled %d bytes, lost %lu\n",
+		    NewSerial.available() + localCount, lost - lostbytes);
+	else
+		DPRINTF("spooled %d bytes\n",
+		    NewSerial.available() + localCount);
+	lostbytes = lost;
 }
 
 // Log to a new file everytime the system boots
 // Checks the spots in EEPROM for the next available LOG# file name
 // Updates EEPROM and then appends to the new log file.
 // Limited to 65535 files but this should not always be the case.
-void
-newlog(void)
+boolean
+newlog(char *fn, size_t size)
 {
-	char fn[32];
-
 	/* Search for next available log */
 	do {
 		if (eeprom.logseq == 0xffff - 1) {
 			/* Don't set logseq to 0xffff */
-			SERIAL_PUTSTR("Too many logs!\n");
-			return;
+			DPUTSTR("Too many logs!\n");
+			return (0);
 		}
 
 		// Splice the new file number into this file name
-		snprintf_P(fn, sizeof(fn), PSTR("LOG%05d.TXT"), eeprom.logseq);
+		snprintf_P(fn, size, PSTR("LOG%05d.TXT"), eeprom.logseq);
 
 		/* Set the next number number to use */
 		++eeprom.logseq;
-	} while (!file.open(&curdir, fn, O_CREAT | O_EXCL | O_WRITE));
+	} while (!sdlat_open(&file, &curdir, fn, O_CREAT | O_EXCL | O_WRITE));
 
 	if (eeprom_write(0) < 0)
-		serial_putstr(FV(msg_eepromfail));
+		serial_dputstr(FV(msg_eepromfail));
 
 	// Close this new file we just opened
-	file.close();
+	sdlat_close(&file);
 
-	PRINTF("Created %s\n", fn);
-	serial_putstr(FV(msg_prompt));
+	DPRINTF("Created %s\n%S", fn, msg_prompt);
+	return (1);
+}
+
+static const char seqname[] PROGMEM = "SEQLOG00.TXT";
 
-	append_file(fn);
+/* A rotate would only reopen SEQLOG00.TXT so there isn't one */
+boolean
+rotatable(void)
+{
+	return (logname == NULL || strcmp_P(logname, seqname) != 0);
 }
 
 // Log to the same file every time the system boots, sequentially
@@ -222,20 +498,17 @@ newlog(void)
 // If yes, append to it
 // Return 0 on error
 // Return anything else on sucess
-void
-seqlog(void)
+boolean
+seqlog(char *fn, size_t size)
 {
-	char fn[32];
-
 	/* Try to create sequential file */
-	strlcpy_P(fn, PSTR("SEQLOG00.TXT"), sizeof(fn));
-	if (!file.open(&curdir, fn, O_CREAT | O_WRITE)) {
-		PRINTF("error creating %s\n", fn);
-		return;
+	strlcpy_P(fn, seqname, size);
+	if (!sdlat_open(&file, &curdir, fn, O_CREAT | O_WRITE)) {
+		DPRINTF("error creating %s\n", fn);
+		return (0);
 	}
-	file.close();
-
-	append_file(fn);
+	sdlat_close(&file);
+	return (1);
 }
 
 // This is the most important function of the device. These loops
@@ -245,19 +518,23 @@ seqlog(void)
 // Appends a stream of serial data to a given file
 // Assumes the currentDirectory variable has been set before entering
 // the routine
-void
+// Returns 0 when the card is removed or it's time for a new log
+// (file_name is cleared), otherwise the error code
+uint8_t
 append_file(char *file_name)
 {
-	size_t cc;
-	boolean ok;
-	uint16_t idleTime;
-	uint8_t localBuffer[32];
+	int16_t n;
+	int8_t e;
+	boolean ok, rotate;
 
 	// O_CREAT - create the file if it does not exist
 	// O_APPEND - seek to the end of the file prior to each write
 	// O_WRITE - open for write
-	if (!file.open(&curdir, file_name, O_CREAT | O_APPEND | O_WRITE))
+	if (!sdlat_open(&file, &curdir, file_name,
+	    O_CREAT | O_APPEND | O_WRITE)) {
 		error("open1");
+		return (ERROR_SD_OPEN);
+	}
 
 	/*
 	 * This is a trick to make sure first cluster is allocated
@@ -265,139 +542,323 @@ append_file(char *file_name)
 	 */
 	if (file.fileSize() == 0) {
 		file.rewind();
-		file.sync();
+		if (!sdlat_sync(&file)) {
+			error("sync1");
+			file = SdFile();
+			return (ERROR_SD_WRITE);
+		}
 	}
 
-	idleTime = 0;
-
-	// Ugly calculation to figure out how many times to loop
-	// before we need to force a record (file.sync())
-	uint32_t maxLoops;
-
-	// Sync the file every maxLoop # of bytes
-	uint16_t timeSinceLastRecord = 0;
-
-	/* Bits per second */
-	maxLoops = UART0_BAUD;
-
-	/* Convert to bytes per second */
-	maxLoops /= 8;
-
-	/* Convert to # of loops per second */
-	maxLoops /= sizeof(localBuffer);
-#ifdef notdef
-	PRINTF("maxLoops: %d\n", maxLoops);
-#endif
+	dirty = 0;
+	drainerr = 0;
+	rotate = 0;
+	lastdata = msec;
+	lastsync = msec;
+	written = 0;
+	logname = file_name;
 
 	// Start recording incoming characters
 	led_red(0);
 	status_set(0, STATUS_STATE_ERROR);
+	/* Open again; the backoff only resets once a write is synced */
+	if (recover_tries != 0) {
+		status_set(0, STATUS_STATE_RECOVERING | STATUS_STATE_FAILED);
+		led_mode(LED_MODE_RUN);
+	}
 	for (;;) {
-		/* Give main loop some time */
+		/* Give main loop some time; console output may drain() */
+		capturing = 1;
 		loop();
+		capturing = 0;
 
-		/* Read from the serial port */
-		uint8_t n = NewSerial.read(localBuffer, sizeof(localBuffer));
-		if (n > 0) {
-			led_red(1);
-			cc = file.write(localBuffer, n);
-			status_set((cc != n), STATUS_STATE_ERROR);
+		/* Card went away; leave the data in the RX ring */
+		if (!STATUS_PRESENT(status))
+			break;
+
+		/* Hard stop if capture_yield() had errors */
+		if (drainerr)
+			break;
+
+		/* The speed changed; start a new log at that point */
+		if (splitting && splitleft == 0) {
+			splitting = 0;
+			if (written > 0 && rotatable()) {
+				rotate = 1;
+				break;
+			}
+		}
+
+		/* Host commands run once what came before them is logged */
+		if (!cmdpending && status_getcmd(&hcmd)) {
+			cmdleft = ((long)(hcmd.pos - received) > 0) ?
+			    hcmd.pos - received : 0;
+			cmdpending = 1;
+		}
+		if (cmdpending && cmdleft == 0 && localCount == 0) {
+			cmdpending = 0;
+			e = hostcmd(&hcmd);
 			/* Hard stop if there were errors */
-			if (cc != n)
+			if (e < 0)
+				break;
+			if (e > 0) {
+				rotate = 1;
 				break;
+			}
+			continue;
+		}
 
-			/* We have characters so reset the idleTime */
-			idleTime = 0;
+		n = drain();
+		/* Hard stop if there were errors */
+		if (n < 0)
+			break;
+		if (n > 0) {
+			/* Time for a new log? */
+			if (eeprom.rotatekb != 0 &&
+			    written >= ((u_long)eeprom.rotatekb << 10) &&
+			    rotatable()) {
+				rotate = 1;
+				break;
+			}
 
-			/* This will force a sync approximately every second */
-			if (timeSinceLastRecord++ > maxLoops) {
-				timeSinceLastRecord = 0;
-				ok = file.sync();
+			/* Sync every eeprom.syncms even if data keeps coming */
+			if (eeprom.syncms != 0 &&
+			    MILLIS_SUB(msec, lastsync) >= eeprom.syncms) {
+				lastsync = msec;
+				ok = sdlat_sync(&file);
 				status_set(!ok, STATUS_STATE_ERROR);
 				/* Hard stop if there were errors */
 				if (!ok)
 					break;
 				led_red(0);
+				dirty = 0;
+				recovered();
 			}
 			continue;
 		}
-		if (idleTime > MAX_IDLE_MS) {
-			ok = file.sync();
+
+		/* Sync once after eeprom.idlems (msec is kept by the tick) */
+		if (dirty && MILLIS_SUB(msec, lastdata) > eeprom.idlems) {
+			lastsync = msec;
+			ok = sdlat_sync(&file);
 			status_set(!ok, STATUS_STATE_ERROR);
 			/* Hard stop if there were errors */
 			if (!ok)
 				break;
 			led_red(0);
-
-#ifdef notdef
-			// Shut down peripherals we don't need
-			power_timer0_disable();
-			power_spi_disable();
-
-			// Stop everything and go to sleep. Wake
-			// up if serial character received
-			sleep_mode();
-
-			// After wake up, power up peripherals
-			power_spi_enable();
-			power_timer0_enable();
-#endif
-
-			// A received character woke us up to reset the idleTime
-			idleTime = 0;
+			dirty = 0;
+			recovered();
 			continue;
 		}
 
-		// Burn 1ms waiting for new characters coming in
-		++idleTime;
-		delay(1);
+		/* Sleep until a character arrives or the next tick */
+		sched_idle();
 	}
 
-	ok = file.sync();
-	status_set(!ok, STATUS_STATE_ERROR);
-	/* Hard stop if there were errors */
-	if (!ok)
-		blink_error(ERROR_SD_WRITE);
-	led_red(0);
+	/* Card was pulled; abandon the file, the next card gets a new log */
+	if (!STATUS_PRESENT(status) || !CARD_PRESENT()) {
+		DPRINTF("spooling to ram (%u bytes free)\n",
+		    UART0_RXSIZE - NewSerial.available());
+		status_set(0, STATUS_STATE_ERROR);
+		file = SdFile();
+		return (0);
+	}
+
+	/* Rotate; the caller opens a new log */
+	if (rotate) {
+		if (!sdlat_close(&file)) {
+			error("close");
+			file = SdFile();
+			return (ERROR_SD_WRITE);
+		}
+		DPRINTF("closed %s after %lu bytes\n", file_name, written);
+		file_name[0] = '\0';
+		return (0);
+	}
 
-	// Done recording, close out the file
-	ok = file.close();
-	status_set(!ok, STATUS_STATE_ERROR);
+	/* Write error; try to save what we can, the caller recovers */
+	error("write");
+	(void)sdlat_sync(&file);
+	file = SdFile();
+	return (ERROR_SD_WRITE);
 }
 
-// The following are system functions needed for basic operation
-// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+/*
+ * Write a chunk from the RX ring (or the one left over from a card
+ * that was pulled in the middle of a write) to the log. Returns the
+ * bytes written, 0 if there was nothing to write or -1 on errors.
+ */
+int16_t
+drain(void)
+{
+	size_t cc;
+	uint8_t n;
+	int16_t r;
+	uint8_t tbuf[TRIGGER_MAX];
+
+	if (localCount == 0) {
+		PROF_SET(PROF_DRAIN);
+
+		cc = min(eeprom.chunk, sizeof(localBuffer));
+		if (splitting && splitleft < cc)
+			cc = splitleft;
+		if (cmdpending && cmdleft < cc)
+			cc = cmdleft;
+		localCount = NewSerial.read(localBuffer, cc);
+		received += localCount;
+		if (cmdpending)
+			cmdleft -= localCount;
+		PROF_RESTORE();
+		PROF_BYTES(localCount);
+		stats_drain(localCount);
+		tail_put(localBuffer, localCount);
+
+		/* Paused: drop it unless the trigger shows up */
+		if (paused && localCount > 0) {
+			r = trigger_scan(localBuffer, localCount);
+			if (r < 0) {
+				if (splitting)
+					splitleft -= localCount;
+				localCount = 0;
+				return (0);
+			}
 
-// Blinks the status LEDs to indicate a type of error
-void
-blink_error(uint8_t e)
+			/* The log picks up with the trigger */
+			if (splitting)
+				splitleft -= r;
+			localCount -= r;
+			memmove(localBuffer, localBuffer + r, localCount);
+			paused = 0;
+			status_set(0, STATUS_STATE_PAUSED | STATUS_STATE_ARMED);
+			n = trigger_get(tbuf);
+			led_red(1);
+			cc = sdlat_write(&file, tbuf, n);
+			status_set((cc != n), STATUS_STATE_ERROR);
+			if (cc != n)
+				return (-1);
+			lastdata = msec;
+			dirty = 1;
+			written += n;
+			logged += n;
+		}
+	}
+	n = localCount;
+	if (n == 0)
+		return (0);
+	led_red(1);
+	cc = sdlat_write(&file, localBuffer, n);
+	status_set((cc != n), STATUS_STATE_ERROR);
+	if (cc != n)
+		return (-1);
+	localCount = 0;
+	if (splitting)
+		splitleft -= n;
+
+	/* We have characters so restart the idle timer */
+	lastdata = msec;
+	dirty = 1;
+	written += n;
+	logged += n;
+	return (n);
+}
+
+/*
+ * Run a host command (I2C) now that what came before it is in the
+ * log. Returns -1 on errors, 1 to start a new log and 0 otherwise.
+ */
+int8_t
+hostcmd(const struct status_cmd *cp)
 {
-	PRINTF("blink_error %d\n", e);
-	led_mode(e);
-	for (;;)
-		loop();
+	boolean ok;
+	int8_t ret;
+
+	ret = 0;
+	switch (cp->cmd) {
+
+	case STATUS_CMD_SYNC:
+		lastsync = msec;
+		ok = sdlat_sync(&file);
+		status_set(!ok, STATUS_STATE_ERROR);
+		if (!ok)
+			return (-1);
+		led_red(0);
+		dirty = 0;
+		recovered();
+		break;
+
+	case STATUS_CMD_ROTATE:
+		/* Not for an empty log */
+		if (written > 0 && rotatable())
+			ret = 1;
+		break;
+
+	case STATUS_CMD_MARK:
+		if (cp->len == 0)
+			break;
+		led_red(1);
+		ok = (sdlat_write(&file, cp->arg, cp->len) == cp->len);
+		status_set(!ok, STATUS_STATE_ERROR);
+		if (!ok)
+			return (-1);
+		lastdata = msec;
+		dirty = 1;
+		written += cp->len;
+		logged += cp->len;
+		break;
+
+	case STATUS_CMD_TRIGGER:
+		/* An empty one clears it */
+		trigger_set(cp->arg, cp->len);
+		paused = trigger_armed();
+		break;
+
+	case STATUS_CMD_PAUSE:
+		trigger_set(cp->arg, 0);
+		paused = 1;
+		break;
+
+	case STATUS_CMD_RESUME:
+		trigger_set(cp->arg, 0);
+		paused = 0;
+		break;
+	}
+	status_set(paused, STATUS_STATE_PAUSED);
+	status_set(trigger_armed(), STATUS_STATE_ARMED);
+	status_cmddone();
+	return (ret);
 }
 
+// The following are system functions needed for basic operation
+// =-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
 static const char dottxt[] PROGMEM = ".TXT";
 
-void
-datelog(void)
+/* datelog() names after the current one to try */
+#define DATELOG_TRIES	8
+
+boolean
+datelog(char *fn, size_t fnsize)
 {
 	char *cp;
 	int8_t i, size, cc;
-	uint16_t uv;
-	struct rtc_time *rt;
-	char fn[sizeof("12345678.TXT")];
+	uint8_t tries;
+	uint16_t uv, fdate, ftime;
+
+	if (fnsize < sizeof("12345678.TXT"))
+		return (0);
 
-	rt = &rtc_time;
+	/* From RAM (rtc_poll() keeps it), no I2C in the middle of capture */
+	fdate = 0;
+	rtc_datetime(&fdate, &ftime);
+	if (fdate == 0)
+		return (0);
 	cp = fn;
-	size = sizeof(fn);
+	size = sizeof("12345678.TXT");
 
 	/* 16 bits of y/m/d fits in 4 chars of base 36 */
-	uv = FAT_DATE(RTC2YEAR(rt), RTC2MONTH(rt), RTC2DAY(rt));
+	uv = fdate;
 	cc = ui2str(uv, cp, size, 36);
 	if (cc < 0)
-		return;
+		return (0);
 
 	/* Zero pad to 4 chars */
 	i = 4 - cc;
@@ -409,35 +870,40 @@ datelog(void)
 	cp += cc;
 	size -= cc;
 
-	/* 16 bits of h:m:(s/2) fits in 4 chars of base 36 */
-	uv = FAT_TIME(RTC2HOUR(rt), RTC2MIN(rt), RTC2SEC(rt));
-	cc = ui2str(uv, cp, size, 36);
-	if (cc < 0)
-		return;
-
-	/* Zero pad to 4 chars */
-	i = 4 - cc;
-	if (i > 0) {
-		memmove(cp + i, cp, cc + 1);
-		memset(cp, '0', i);
-		cc += i;
-	}
-	cp += cc;
-	size -= cc;
+	/*
+	 * 16 bits of h:m:(s/2) fits in 4 chars of base 36. A log from
+	 * the same two seconds (a rotate) takes the next value so it
+	 * doesn't reopen the last one.
+	 */
+	uv = ftime;
+	for (tries = 0;; ++tries) {
+		cc = ui2str(uv, cp, size, 36);
+		if (cc < 0)
+			return (0);
+
+		/* Zero pad to 4 chars */
+		i = 4 - cc;
+		if (i > 0) {
+			memmove(cp + i, cp, cc + 1);
+			memset(cp, '0', i);
+			cc += i;
+		}
 
-	/* add ".TXT" */
-	if (size < (int8_t)sizeof(dottxt))
-		return;
-	strlcpy_P(cp, dottxt, size);
+		/* add ".TXT" */
+		if (size - cc < (int8_t)sizeof(dottxt))
+			return (0);
+		strlcpy_P(cp + cc, dottxt, size - cc);
 
-	if (!file.open(&curdir, fn, O_CREAT | O_WRITE | O_APPEND))
-		return;
+		if (sdlat_open(&file, &curdir, fn, O_CREAT | O_EXCL | O_WRITE))
+			break;
+		if (tries >= DATELOG_TRIES)
+			return (0);
+		++uv;
+	}
 
 	/* Close this new file we just opened */
-	file.close();
-
-	PRINTF("Created %s\n", fn);
-	serial_putstr(FV(msg_prompt));
+	sdlat_close(&file);
 
-	append_file(fn);
+	DPRINTF("Created %s\n%S", fn, msg_prompt);
+	return (1);
 }
@@ -10,6 +10,8 @@
 
 #include <SdFat.h>
 
+#include "NewSerialPort.h"
+
 #define ISSET(v, bm) (((v) & (bm)) == (bm))
 
 /* Subtract t2 from t1; handles overflow correctly */
@@ -25,6 +27,9 @@
 #define UART0_SIZE 2000
 #endif
 
+/* RX ring bytes (it holds one less); a power of two wraps with a mask */
+#define UART0_RXSIZE	(UART0_SIZE - 1)
+
 #ifndef UART1_BAUD
 #define UART1_BAUD 57600
 #endif
@@ -37,6 +42,7 @@
 #if defined(__AVR_ATmega644P__) || defined(__AVR_ATmega1284P__)
 #define LED_GREEN	0		/* d0 */
 #define LED_RED		1		/* d1 */
+#define PIN_RTC_SQW	2		/* d2: DS3231 SQW (INT2) */
 
 					/* d4: SPI/SS */
 					/* d5: SPI/MOSI */
@@ -85,4 +91,11 @@ extern SdVolume volume;
 extern Sd2Card card;
 extern SdFile file;
 extern u_long msec;
+
+extern NewSerialPort<0, UART0_RXSIZE, 0> NewSerial;
+
+extern void capture_begin(uint32_t);
+extern void capture_speed(uint32_t);
+extern void capture_status(struct status_log *);
+extern void cd_poll(void);
 #endif
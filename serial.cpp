@@ -37,12 +37,20 @@
 
 #include <wiring_private.h>
 
+#include <NewSerialPort.h>
+
+#include "audit.h"
+#include "prof.h"
 #include "serial.h"
 
 #ifndef IBUFSIZE
 #define IBUFSIZE	64
 #endif
 
+/* Console ring capacities */
+#define UART1_RXSIZE	63
+#define UART1_TXSIZE	63
+
 /* Next position in circular input buffer */
 #define IBUF_NEXTP(p) (((p) < ibuf + IBUFSIZE - 1) ? (p) + 1 : ibuf)
 
@@ -57,41 +65,228 @@ static char *ip;			/* owned by main */
 static char *igp;			/* owned by serial_getln() */
 static char *iep;			/* owned by serial */
 static char ibuf[IBUFSIZE];		/* input buffer */
+static volatile boolean txnl;		/* owe a '\n' after the '\r' */
+static u_long dropped;			/* diagnostic messages */
+static void (*onyield)(void);
+static boolean yielding;
+static volatile boolean intr;		/* ^C seen */
+static volatile boolean raw;		/* binary output, no '\r' */
+
+/* Forwards */
+static void serial_write(const char *, size_t, boolean);
+static void serial_yield(void);
+
+/*
+ * Baud rate table; the divisor, U2X and error for each speed are
+ * worked out at compile time for F_CPU. 16x sampling (U2X off) is
+ * more tolerant so it wins ties. Speeds that don't fit in UBRR or
+ * are off by more than SERIAL_MAXPPM are rejected.
+ */
+struct serial_baud {
+	uint32_t speed;
+	uint16_t ubrr;
+	uint8_t u2x;
+	int32_t ppm;
+};
+
+static constexpr uint32_t
+sb_ubrr(uint32_t speed, uint8_t div)
+{
+	return (((F_CPU + ((div * speed) / 2)) / (div * speed)) - 1);
+}
+
+static constexpr int32_t
+sb_abs(int32_t v)
+{
+	return (v < 0 ? -v : v);
+}
+
+static constexpr int32_t
+sb_ppm(uint32_t speed, uint8_t div)
+{
+	return (sb_ubrr(speed, div) > 4095 ? INT32_MAX :
+	    (int32_t)(((int64_t)F_CPU * 1000000) /
+	    ((int64_t)div * (sb_ubrr(speed, div) + 1) * speed) - 1000000));
+}
+
+static constexpr uint8_t
+sb_u2x(uint32_t speed)
+{
+	return (sb_abs(sb_ppm(speed, 16)) <= sb_abs(sb_ppm(speed, 8)) ? 0 : 1);
+}
 
-/* speeds below 600 might not work */
-static const uint32_t speeds[] PROGMEM = {
-	110,
-	134,
-	150,
-	200,
-	300,
-	600,
-	1200,
-	1800,
-	2400,
-	4800,
-	7200,
-	9600,
-	14400,
-	19200,
-	28800,
-	38400,
-	57600,
-	76800,
-	115200,
-	230400,
-	460800,
-	500000,
-	921600,
-	0,
+#define SB_DIV(s) (sb_u2x(s) ? 8 : 16)
+#define SB(s) \
+    { s, (uint16_t)sb_ubrr(s, SB_DIV(s)), sb_u2x(s), sb_ppm(s, SB_DIV(s)) }
+#define SB_OK(s) (sb_abs(sb_ppm(s, SB_DIV(s))) <= SERIAL_MAXPPM)
+
+static_assert(SB_OK(UART0_BAUD), "UART0_BAUD isn't usable at F_CPU");
+
+static const struct serial_baud speeds[] PROGMEM = {
+	SB(110),
+	SB(134),
+	SB(150),
+	SB(200),
+	SB(300),
+	SB(600),
+	SB(1200),
+	SB(1800),
+	SB(2400),
+	SB(4800),
+	SB(7200),
+	SB(9600),
+	SB(14400),
+	SB(19200),
+	SB(28800),
+	SB(38400),
+	SB(57600),
+	SB(76800),
+	SB(115200),
+	SB(230400),
+	SB(460800),
+	SB(500000),
+	SB(921600),
+	SB(1843200),
 };
+#define NSPEEDS ((uint8_t)(sizeof(speeds) / sizeof(speeds[0])))
+
+NewSerialPort<1, UART1_RXSIZE, UART1_TXSIZE> NewSerial1;
+
+/*
+ * The console handlers turn interrupts back on once the USART is
+ * serviced so the capture RX interrupt can preempt them
+ */
+ISR(SERIAL_RX1_vect)
+{
+	uint8_t b, e;
+	AUDIT_ENTER();
+
+	/* Reading UDR clears RXC; mask it so the next byte can't nest */
+	e = 0;
+	b = NewSerial1.rxRead(&e);
+	UCSR1B &= ~_BV(RXCIE1);
+	AUDIT_SEI();
+	NewSerial1.rxStore(b, e);
+	cli();
+	UCSR1B |= _BV(RXCIE1);
+	AUDIT_EXIT(AUDIT_RX1);
+}
+
+ISR(SERIAL_UDRE1_vect)
+{
+	uint8_t b;
+	boolean send;
+	AUDIT_ENTER();
+
+	/* Level triggered; mask it while interrupts are on */
+	UCSR1B &= ~_BV(UDRIE1);
+	AUDIT_SEI();
+
+	/* Newlines are expanded here so writers can copy whole strings */
+	send = 1;
+	if (txnl) {
+		txnl = 0;
+		b = '\n';
+	} else if (!NewSerial1.txGet(&b))
+		send = 0;
+	else if (b == '\n' && !raw) {
+		txnl = 1;
+		b = '\r';
+	}
+	if (send) {
+		/* TXC1 tells serial_setspeed() when the last one is out */
+		UCSR1A = (UCSR1A & _BV(U2X1)) | _BV(TXC1);
+		UDR1 = b;
+		cli();
+		UCSR1B |= _BV(UDRIE1);
+	}
+	AUDIT_EXIT(AUDIT_TX1);
+}
+
+/* Look up the UBRR and U2X for a speed, returns 0 if it's rejected */
+boolean
+serial_divisor(uint32_t speed, uint16_t *ubrrp, boolean *u2xp)
+{
+	uint8_t i;
+	struct serial_baud sb;
+
+	for (i = 0; i < NSPEEDS; ++i) {
+		memcpy_P(&sb, &speeds[i], sizeof(sb));
+		if (sb.speed != speed)
+			continue;
+		if (sb_abs(sb.ppm) > SERIAL_MAXPPM)
+			return (0);
+		if (ubrrp != NULL)
+			*ubrrp = sb.ubrr;
+		if (u2xp != NULL)
+			*u2xp = sb.u2x;
+		return (1);
+	}
+	return (0);
+}
+
+/*
+ * Diagnostic output: the whole message or nothing (counted), it
+ * never waits for the console
+ */
+void
+serial_dprintf_P(PGM_P fmt, ...)
+{
+	int n;
+	va_list ap;
+	char buf[SERIAL_DBUFSIZE];
+
+	/* Don't mix with binary output */
+	if (raw) {
+		++dropped;
+		return;
+	}
+	va_start(ap, fmt);
+	n = vsnprintf_P(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if (n >= (int)sizeof(buf))
+		n = sizeof(buf) - 1;
+	if (n > NewSerial1.availableForWrite()) {
+		++dropped;
+		return;
+	}
+	(void)NewSerial1.tryWrite((const uint8_t *)buf, n);
+}
+
+void
+serial_dputstr(const __FlashStringHelper *s)
+{
+	int n;
+	PGM_P p = reinterpret_cast<PGM_P>(s);
 
-NewSerialPort<1, 63, 63> NewSerial1;
+	n = strlen_P(p);
+	if (raw || n > NewSerial1.availableForWrite()) {
+		++dropped;
+		return;
+	}
+	(void)NewSerial1.tryWrite_P(p, n);
+}
+
+/* Diagnostic messages dropped */
+u_long
+serial_dropped(boolean reset)
+{
+	u_long n;
+
+	n = dropped;
+	if (reset)
+		dropped = 0;
+	return (n);
+}
 
 void
 serial_flush(void)
 {
 	NewSerial1.flush();
+	while (txnl)
+		continue;
 }
 
 /* Returns true if a line was returned, else false */
@@ -232,12 +427,42 @@ serial_getln(char *buf, size_t size)
 	return (0);
 }
 
+/* Console ring high-water marks */
+void
+serial_highwater(uint16_t *rxp, uint16_t *txp, boolean reset)
+{
+	*rxp = NewSerial1.rxHighWater();
+	*txp = NewSerial1.txHighWater();
+	if (reset)
+		NewSerial1.clearHighWater();
+}
+
+/* Bytes that can be output without waiting */
+int
+serial_room(void)
+{
+	return (NewSerial1.availableForWrite());
+}
+
+/* Static RAM used by the console rings and the input buffer */
+uint16_t
+serial_ram(void)
+{
+	return ((UART1_RXSIZE + 1) + (UART1_TXSIZE + 1) + sizeof(ibuf));
+}
+
 /* Initialize Serial Interface */
 void
 serial_init(uint32_t speed)
 {
+	uint16_t ubrr;
+	boolean u2x;
+
 	/* Initialize main serial */
-	NewSerial1.begin(speed);
+	if (serial_divisor(speed, &ubrr, &u2x))
+		NewSerial1.beginUbrr(ubrr, u2x);
+	else
+		NewSerial1.begin(speed);
 
 	/* avr-libc printf() setup */
 	(void)fdevopen(serial_putc, NULL);
@@ -248,24 +473,73 @@ serial_init(uint32_t speed)
 	igp = ip;
 }
 
+/* Return the speed between lo and hi closest to speed (or 0) */
+uint32_t
+serial_matchspeed(uint32_t speed, uint32_t lo, uint32_t hi)
+{
+	uint8_t i;
+	uint32_t best, d, bestd;
+	struct serial_baud sb;
+
+	best = 0;
+	bestd = 0;
+	for (i = 0; i < NSPEEDS; ++i) {
+		memcpy_P(&sb, &speeds[i], sizeof(sb));
+		if (sb_abs(sb.ppm) > SERIAL_MAXPPM ||
+		    sb.speed < lo || sb.speed > hi)
+			continue;
+		d = (sb.speed > speed) ? sb.speed - speed : speed - sb.speed;
+		if (best == 0 || d < bestd) {
+			best = sb.speed;
+			bestd = d;
+		}
+	}
+	return (best);
+}
+
 void
 serial_nl(void)
 {
 	serial_putchar('\n');
 }
 
+/* Returns true (once) if ^C was typed */
+boolean
+serial_intr(void)
+{
+	boolean v;
+
+	v = intr;
+	intr = 0;
+	return (v);
+}
+
+/* Called while interactive output waits for room in the console ring */
+void
+serial_onyield(void (*func)(void))
+{
+	onyield = func;
+}
+
 /* Look to see if there are any new characters */
 void
 serial_poll(void)
 {
 	int ch;
 	char *p;
+	PROF_SET(PROF_CONSOLE);
 
 	while (NewSerial1.available() > 0) {
 		ch = NewSerial1.read();
 		if (ch == '\0')
 			continue;
 
+		/* ^C stops a console job */
+		if (ch == '\003') {
+			intr = 1;
+			continue;
+		}
+
 		/*
 		 * Allow erase characters, CR, or NL to fill second
 		 * to last position
@@ -279,6 +553,7 @@ serial_poll(void)
 		*iep = ch;
 		iep = p;
 	}
+	PROF_RESTORE();
 }
 
 void
@@ -301,49 +576,81 @@ serial_putc(char ch, FILE *f)
 int
 serial_putchar(char ch)
 {
-	if (ch == '\n')
-		NewSerial1.write('\r');
-	NewSerial1.write(ch);
+	serial_write(&ch, 1, 0);
 	return (0);
 }
 
+/* Binary data (see serial_raw()) */
+void
+serial_putbuf(const uint8_t *buf, size_t n)
+{
+	serial_write((const char *)buf, n, 0);
+}
+
 /* Non-const version assumes string is stored in ram */
 void
 serial_putstr(char *s)
 {
-	char ch;
-
-	while ((ch = *s++) != '\0')
-		serial_putchar(ch);
+	serial_write(s, strlen(s), 0);
 }
 
 /* Const version assumes string is stored in flash */
 void
 serial_putstr(const __FlashStringHelper *s)
 {
-	char ch;
 	PGM_P p = reinterpret_cast<PGM_P>(s);
 
-	while ((ch = pgm_read_byte(p++)) != '\0')
-		serial_putchar(ch);
+	serial_write(p, strlen_P(p), 1);
+}
+
+/* Turn newline expansion off for binary output (after it's sent) */
+void
+serial_raw(boolean on)
+{
+	serial_flush();
+	raw = on;
+}
+
+/* Report the divisor and error for each speed */
+void
+serial_prbauds(void)
+{
+	uint8_t i;
+	int32_t ppm;
+	struct serial_baud sb;
+
+	SERIAL_PUTSTR("  speed ubrr u2x   error\n");
+	for (i = 0; i < NSPEEDS; ++i) {
+		memcpy_P(&sb, &speeds[i], sizeof(sb));
+		if (sb.ppm == INT32_MAX) {
+			PRINTF("%7lu    -   -       -  rejected\n", sb.speed);
+			continue;
+		}
+		ppm = sb_abs(sb.ppm);
+		PRINTF("%7lu %4u %3u %c%d.%02d%%", sb.speed, sb.ubrr, sb.u2x,
+		    sb.ppm < 0 ? '-' : '+', (int)(ppm / 10000),
+		    (int)((ppm / 100) % 100));
+		if (ppm > SERIAL_MAXPPM)
+			SERIAL_PUTSTR("  rejected");
+		serial_nl();
+	}
 }
 
 void
 serial_prspeeds(void)
 {
 	boolean didany;
+	uint8_t i;
 	int8_t col;
-	uint32_t speed;
-	const uint32_t *up;
+	struct serial_baud sb;
 	char buf[8];
 
-	up = speeds;
 	col = 0;
 	didany = 0;
-	for (;;) {
-		speed = pgm_read_u32(up++);
-		if (speed == 0)
-			break;
+	for (i = 0; i < NSPEEDS; ++i) {
+		memcpy_P(&sb, &speeds[i], sizeof(sb));
+		if (sb_abs(sb.ppm) > SERIAL_MAXPPM)
+			continue;
 		if (col > 68) {
 			serial_nl();
 			col = 0;
@@ -353,7 +660,7 @@ serial_prspeeds(void)
 			col += 4;
 			didany = 0;
 		}
-		snprintf_P(buf, sizeof(buf), PSTR("%lu"), speed);
+		snprintf_P(buf, sizeof(buf), PSTR("%lu"), sb.speed);
 		if (didany) {
 			serial_putchar(' ');
 			++col;
@@ -373,20 +680,57 @@ serial_ready(void)
 	return (ip != iep);
 }
 
+/* Change the console speed once everything queued has gone out */
+void
+serial_setspeed(uint32_t speed)
+{
+	uint16_t ubrr;
+	boolean u2x;
+	u_long t0;
+
+	if (!serial_divisor(speed, &ubrr, &u2x))
+		return;
+	serial_flush();
+	/* Let the last character out of the shift register */
+	t0 = millis();
+	while ((UCSR1A & _BV(TXC1)) == 0 &&
+	    (u_long)(millis() - t0) < SERIAL_TXCMS)
+		continue;
+	NewSerial1.beginUbrr(ubrr, u2x);
+}
+
 /* Returns true if speed is valid */
 boolean
 serial_speed(uint32_t speed)
 {
-	uint32_t speed2;
-	const uint32_t *up;
+	return (serial_divisor(speed, NULL, NULL));
+}
 
-	up = speeds;
-	for (;;) {
-		speed2 = pgm_read_u32(up++);
-		if (speed2 == 0)
-			break;
-		if (speed2 == speed)
-			return (1);
+/* Interactive output: copy into the console ring, yielding when it's full */
+static void
+serial_write(const char *p, size_t n, boolean flash)
+{
+	size_t m;
+
+	while (n > 0) {
+		if (flash)
+			m = NewSerial1.tryWrite_P(p, n);
+		else
+			m = NewSerial1.tryWrite((const uint8_t *)p, n);
+		p += m;
+		n -= m;
+		if (n > 0)
+			serial_yield();
 	}
-	return (0);
+}
+
+/* Let the capture side run while the console drains (not recursively) */
+static void
+serial_yield(void)
+{
+	if (onyield == NULL || yielding)
+		return;
+	yielding = 1;
+	(*onyield)();
+	yielding = 0;
 }
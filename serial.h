@@ -9,9 +9,18 @@
 
 #define UART0_BAUD 57600
 
+/* Largest baud rate error we'll use (ppm) */
+#define SERIAL_MAXPPM 10000
+
 /* Don't print bell for invalid characters until we've been up this long */
 #define QUIET_MS 50
 
+/* Longest diagnostic message */
+#define SERIAL_DBUFSIZE 80
+
+/* Longest a character takes to send (300 baud) */
+#define SERIAL_TXCMS 40
+
 #include "NewSerialPort.h"
 
 #define PRINTF(format, ...) printf_P(PSTR(format), ## __VA_ARGS__)
@@ -19,18 +28,36 @@
 #define SERIAL_PUTSTR(s) serial_putstr(F(s))
 #define SERIAL_PUTSTR64K(s) SERIAL_PUTSTR(s)
 
+/* Diagnostics are dropped (and counted) rather than wait for the console */
+#define DPRINTF(format, ...) serial_dprintf_P(PSTR(format), ## __VA_ARGS__)
+#define DPUTSTR(s) serial_dputstr(F(s))
+
+extern boolean serial_divisor(uint32_t, uint16_t *, boolean *);
+extern void serial_dprintf_P(PGM_P, ...);
+extern void serial_dputstr(const __FlashStringHelper *);
+extern u_long serial_dropped(boolean);
 extern void serial_flush(void);
 extern boolean serial_getln(char *, size_t);
+extern void serial_highwater(uint16_t *, uint16_t *, boolean);
 extern void serial_init(uint32_t);
+extern boolean serial_intr(void);
+extern uint32_t serial_matchspeed(uint32_t, uint32_t, uint32_t);
 extern void serial_nl(void);
+extern void serial_onyield(void (*)(void));
 extern void serial_poll(void);
 extern void serial_prone(boolean, const __FlashStringHelper *,
     const __FlashStringHelper *);
+extern void serial_putbuf(const uint8_t *, size_t);
 extern int serial_putc(char, FILE *);
 extern int serial_putchar(char);
 extern void serial_putstr(char *);
 extern void serial_putstr(const __FlashStringHelper *);
+extern uint16_t serial_ram(void);
+extern void serial_prbauds(void);
 extern void serial_prspeeds(void);
+extern void serial_raw(boolean);
 extern boolean serial_ready(void);
+extern int serial_room(void);
+extern void serial_setspeed(uint32_t);
 extern boolean serial_speed(uint32_t);
 #endif
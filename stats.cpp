@@ -0,0 +1,219 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * Capture ring statistics
+ *
+ * The Timer2 tick samples the RX ring occupancy SCHED_HZ times a
+ * second into log2 buckets so each bucket is time spent at that
+ * occupancy. append_file() reports each read from the ring; the time
+ * since the ring was last seen empty bounds how long the oldest byte
+ * sat there and goes into another set of buckets. The rings keep
+ * their own high-water marks. The capture RX interrupt counts the
+ * USART errors (STATS_RXERR()) and the tick traces them.
+ */
+
+#if __has_include("local.h")
+#include "local.h"
+#endif
+
+#include "sdlogger.h"
+
+#include "sched.h"
+#include "serial.h"
+#include "sstrings.h"
+#include "stats.h"
+#include "trace.h"
+
+/* Globals */
+volatile uint16_t stats_overruns;
+volatile uint16_t stats_framing;
+volatile uint16_t stats_parity;
+
+/* Locals */
+static volatile uint32_t occ[STATS_OCCBUCKETS];	/* ticks */
+static uint32_t drain[STATS_DRAINBUCKETS];	/* reads */
+static volatile uint16_t drainmax;		/* ms */
+static u_long emptyms;				/* ring last seen empty */
+static uint16_t tracelevel;			/* occupancy last traced */
+
+/* Forwards */
+static uint8_t stats_log2(u_long, uint8_t);
+static void stats_prbuckets(const volatile uint32_t *, uint8_t);
+
+void
+stats_cmd(char *s)
+{
+	uint16_t hwm, rxhwm, txhwm, dor, fe, upe;
+	boolean reset;
+
+	while (isblank(*s))
+		++s;
+	reset = (strcmp_P(s, PSTR("reset")) == 0);
+	if (!reset && *s != '\0') {
+		serial_putstr(FV(msg_errmsg));
+		return;
+	}
+	serial_highwater(&rxhwm, &txhwm, reset);
+	if (reset) {
+		cli();
+		memset((void *)occ, 0, sizeof(occ));
+		drainmax = 0;
+		tracelevel = 0;
+		stats_overruns = 0;
+		stats_framing = 0;
+		stats_parity = 0;
+		sei();
+		memset(drain, 0, sizeof(drain));
+		NewSerial.clearHighWater();
+		(void)serial_dropped(1);
+		return;
+	}
+
+	hwm = NewSerial.rxHighWater();
+	PRINTF("capture ring: %u of %u now, high water %u (%u%%), lost %lu\n",
+	    NewSerial.available(), UART0_RXSIZE, hwm,
+	    (uint16_t)(((u_long)hwm * 100) / UART0_RXSIZE),
+	    NewSerial.getRxLost());
+	stats_rxerrs(&dor, &fe, &upe);
+	PRINTF("capture errors: overrun %u, framing %u, parity %u\n",
+	    dor, fe, upe);
+	PRINTF("console ring: rx high water %u, tx high water %u, "
+	    "dropped %lu\n", rxhwm, txhwm, serial_dropped(0));
+	PRINTF("occupancy (bytes, %ums ticks):\n", SCHED_MS);
+	stats_prbuckets(occ, STATS_OCCBUCKETS);
+	PRINTF("drain latency (ms, longest %u):\n", stats_drainmax());
+	stats_prbuckets(drain, STATS_DRAINBUCKETS);
+}
+
+/* Called after each read from the capture ring (n bytes) */
+void
+stats_drain(uint8_t n)
+{
+	u_long ms, dt;
+
+	ms = millis();
+	if (n > 0) {
+		dt = MILLIS_SUB(ms, emptyms);
+		++drain[stats_log2(dt, STATS_DRAINBUCKETS)];
+		if (dt > 0xffff)
+			dt = 0xffff;
+		if (dt > drainmax) {
+			cli();
+			drainmax = dt;
+			sei();
+		}
+	}
+	if (NewSerial.available() == 0)
+		emptyms = ms;
+}
+
+/* Longest drain latency (ms); safe from the TWI interrupt handler */
+uint16_t
+stats_drainmax(void)
+{
+	uint8_t s;
+	uint16_t v;
+
+	s = SREG;
+	cli();
+	v = drainmax;
+	SREG = s;
+	return (v);
+}
+
+/* 0 for 0 else 1 + floor(log2(v)), limited to n - 1 */
+static uint8_t
+stats_log2(u_long v, uint8_t n)
+{
+	uint8_t i;
+
+	for (i = 0; v != 0 && i < n - 1; ++i)
+		v >>= 1;
+	return (i);
+}
+
+/* Print the non-empty buckets with their share of the total */
+static void
+stats_prbuckets(const volatile uint32_t *bp, uint8_t n)
+{
+	uint8_t i;
+	u_long lo, hi, total;
+	uint32_t v[STATS_DRAINBUCKETS];		/* the larger set */
+
+	total = 0;
+	for (i = 0; i < n; ++i) {
+		cli();
+		v[i] = bp[i];
+		sei();
+		total += v[i];
+	}
+	for (i = 0; i < n; ++i) {
+		if (v[i] == 0)
+			continue;
+		lo = (i == 0) ? 0 : (1UL << (i - 1));
+		hi = (i == 0) ? 0 : (1UL << i) - 1;
+		if (i == n - 1)
+			PRINTF("  %5lu+      ", lo);
+		else
+			PRINTF("  %5lu-%-5lu ", lo, hi);
+		/* Avoid overflowing the percentage */
+		PRINTF("%10lu %3lu%%\n", v[i], total >= 1000000UL ?
+		    v[i] / (total / 100) : (v[i] * 100) / total);
+	}
+}
+
+/* USART error counts; safe from the TWI interrupt handler */
+void
+stats_rxerrs(uint16_t *dorp, uint16_t *fep, uint16_t *upep)
+{
+	uint8_t s;
+
+	s = SREG;
+	cli();
+	*dorp = stats_overruns;
+	*fep = stats_framing;
+	*upep = stats_parity;
+	SREG = s;
+}
+
+/* Called from the Timer2 interrupt handler */
+void
+stats_sample(void)
+{
+	uint8_t e, s;
+	uint16_t n;
+
+	/* The capture RX errors since the last tick */
+	s = SREG;
+	cli();
+	e = NewSerial.getRxError();
+	NewSerial.clearRxError();
+	SREG = s;
+	if (e != 0)
+		trace(TRACE_RXERR, e);
+
+	n = NewSerial.available();
+	++occ[stats_log2(n, STATS_OCCBUCKETS)];
+
+	/*
+	 * Trace each climb by another STATS_TRACESTEP bytes; the level
+	 * follows the ring back down so the next climb is traced too
+	 */
+	if (n >= tracelevel + STATS_TRACESTEP) {
+		tracelevel = n;
+		trace(TRACE_HWM, n);
+	} else if (n + STATS_TRACESTEP < tracelevel)
+		tracelevel = n;
+}
+
+/* "trace clear" starts the climbs over */
+void
+stats_traceclear(void)
+{
+	uint8_t s;
+
+	s = SREG;
+	cli();
+	tracelevel = 0;
+	SREG = s;
+}
@@ -0,0 +1,33 @@
+/* @(#) $Id$ (XSE) */
+
+#ifndef _stats_h_
+#define _stats_h_
+/* log2 buckets: 0, 1, 2-3, 4-7, ... (the last one catches the rest) */
+#define STATS_OCCBUCKETS	15		/* ring occupancy (bytes) */
+#define STATS_DRAINBUCKETS	16		/* drain latency (ms) */
+
+/* Occupancy climbs are traced in steps of this */
+#define STATS_TRACESTEP		(UART0_RXSIZE / 8)
+
+/* Counts the capture RX interrupt handler's error bits without a call */
+#define STATS_RXERR(e) \
+	do { \
+		if (((e) & M_DOR) != 0) \
+			++stats_overruns; \
+		if (((e) & M_FE) != 0) \
+			++stats_framing; \
+		if (((e) & M_UPE) != 0) \
+			++stats_parity; \
+	} while (0)
+
+extern volatile uint16_t stats_overruns;	/* DOR */
+extern volatile uint16_t stats_framing;		/* FE */
+extern volatile uint16_t stats_parity;		/* UPE */
+
+extern void stats_cmd(char *);
+extern void stats_drain(uint8_t);
+extern uint16_t stats_drainmax(void);
+extern void stats_rxerrs(uint16_t *, uint16_t *, uint16_t *);
+extern void stats_sample(void);
+extern void stats_traceclear(void);
+#endif
@@ -4,19 +4,78 @@
 #include "local.h"
 #endif
 
-#include <Wire.h>
-
 #include "sdlogger.h"
 
+#include "fat.h"
+#include "sdlat.h"
 #include "serial.h"
+#include "stats.h"
 #include "status.h"
+#include "twi.h"
+#include "version.h"
+
+/*
+ * What the main line keeps can't be read from the TWI interrupt
+ * while it's changing so status_poll() fills the copy the handler
+ * isn't using and then flips snapcur; the handler runs to
+ * completion before the main line gets back in.
+ */
+struct status_snap {
+	struct status_log log;
+	u_long sdmax;
+	u_long freekb;
+};
+
+#if STATUS_CMDMAX < TWI_BUFSIZE - 1
+#error "STATUS_CMDMAX too small for TWI_BUFSIZE"
+#endif
+#if (STATUS_CMDQ & (STATUS_CMDQ - 1)) != 0
+#error "STATUS_CMDQ must be a power of two"
+#endif
 
 /* Globals */
 uint8_t status;
 extern int8_t mywireaddr;
 
+/* Locals */
+static struct status_snap snaps[2];
+static volatile uint8_t snapcur;	/* the one the handler reads */
+static uint8_t regptr;			/* register pointer */
+static struct status_cmd cmdq[STATUS_CMDQ];
+static uint8_t cmdhead;			/* main line */
+static volatile uint8_t cmdtail;	/* TWI handler */
+static uint16_t cmddone;		/* changed with interrupts off */
+static uint16_t cmddrop;		/* TWI handler */
+static const char firmware[] PROGMEM = VERSION;
+
 /* Forwards */
+static void status_onreceive(const uint8_t *, uint8_t);
 static void status_onrequest(void);
+static void status_put16(uint8_t *, uint16_t);
+static void status_put32(uint8_t *, uint32_t);
+
+/* Count a host command the capture loop has run */
+void
+status_cmddone(void)
+{
+	uint8_t s;
+
+	s = SREG;
+	cli();
+	++cmddone;
+	SREG = s;
+}
+
+/* Take the next host command off the queue, returns 0 if none */
+boolean
+status_getcmd(struct status_cmd *cp)
+{
+	if (cmdhead == cmdtail)
+		return (0);
+	memcpy(cp, &cmdq[cmdhead], sizeof(*cp));
+	cmdhead = (cmdhead + 1) & (STATUS_CMDQ - 1);
+	return (1);
+}
 
 void
 status_init(void)
@@ -26,20 +85,114 @@ status_init(void)
 	addr = TWI_SDLOGGER;
 	status |= STATUS_STATE_ERROR;
 	if (mywireaddr == 0) {
-		Wire.begin(addr);
+		twi_init(addr);
 		mywireaddr = addr;
 	} else if (mywireaddr != addr) {
 		PRINTF("status_init: invalid addr, aborting (%d != %d)\n",
 		    mywireaddr, addr);
 		return;
 	}
-	Wire.onRequest(status_onrequest);
+	status_poll();
+	twi_onreceive(status_onreceive);
+	twi_onrequest(status_onrequest);
 }
 
+/* Called from the TWI interrupt handler: a register or a command */
+static void
+status_onreceive(const uint8_t *buf, uint8_t len)
+{
+	uint8_t next;
+	struct status_cmd *cp;
+
+	if (len == 0)
+		return;
+	if (buf[0] < STATUS_CMD_SYNC) {
+		regptr = buf[0];
+		return;
+	}
+	next = (cmdtail + 1) & (STATUS_CMDQ - 1);
+	if (buf[0] > STATUS_CMD_LAST || next == cmdhead) {
+		++cmddrop;
+		return;
+	}
+	cp = &cmdq[cmdtail];
+	cp->pos = NewSerial.rxPosition();
+	cp->cmd = buf[0];
+	cp->len = len - 1;
+	memcpy(cp->arg, buf + 1, cp->len);
+	cmdtail = next;
+}
+
+/* Called from the TWI interrupt handler */
 static void
 status_onrequest(void)
 {
-	Wire.write(status);
+	uint8_t reg, buf[STATUS_MAP_LEN];
+	uint16_t dor, fe, upe;
+	const struct status_snap *sp;
+
+	reg = regptr;
+	regptr = 0;
+	if (reg >= sizeof(buf)) {
+		/* All 0xff */
+		twi_reply(buf, 0);
+		return;
+	}
+
+	sp = &snaps[snapcur];
+	buf[STATUS_REG_STATUS] = status;
+	status_put16(buf + STATUS_REG_RING, NewSerial.available());
+	status_put16(buf + STATUS_REG_HWM, NewSerial.rxHighWater());
+	status_put16(buf + STATUS_REG_DRAIN, stats_drainmax());
+	buf[STATUS_REG_VERSION] = STATUS_MAP_VERSION;
+	status_put32(buf + STATUS_REG_CAPTURED, sp->log.captured);
+	status_put32(buf + STATUS_REG_WRITTEN, sp->log.written);
+	status_put32(buf + STATUS_REG_LOST, NewSerial.getRxLost());
+	stats_rxerrs(&dor, &fe, &upe);
+	status_put16(buf + STATUS_REG_OVERRUNS, dor);
+	status_put16(buf + STATUS_REG_FRAMING, fe);
+	status_put16(buf + STATUS_REG_PARITY, upe);
+	status_put32(buf + STATUS_REG_SYNCAGE, sp->log.name[0] != '\0' ?
+	    MILLIS_SUB(millis(), sp->log.lastsync) : STATUS_NONE);
+	status_put32(buf + STATUS_REG_SDMAX, sp->sdmax);
+	status_put32(buf + STATUS_REG_SIZE, sp->log.size);
+	status_put32(buf + STATUS_REG_FREEKB, sp->freekb);
+	strncpy_P((char *)buf + STATUS_REG_FIRMWARE, firmware,
+	    STATUS_FIRMWARE_LEN);
+	memcpy(buf + STATUS_REG_NAME, sp->log.name, STATUS_NAME_LEN);
+	status_put16(buf + STATUS_REG_CMDDONE, cmddone);
+	status_put16(buf + STATUS_REG_CMDDROP, cmddrop);
+	twi_reply(buf + reg, sizeof(buf) - reg);
+}
+
+/* Scheduler task: refresh what the main line keeps for the map */
+void
+status_poll(void)
+{
+	u_long v;
+	struct status_snap *sp;
+
+	sp = &snaps[snapcur ^ 1];
+	memset(sp, 0, sizeof(*sp));
+	capture_status(&sp->log);
+	sp->sdmax = sdlat_writemax();
+	v = fat_free();
+	sp->freekb = (v == FAT_UNKNOWN) ? STATUS_NONE : v;
+	snapcur ^= 1;
+}
+
+static void
+status_put16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void
+status_put32(uint8_t *p, uint32_t v)
+{
+	status_put16(p, v & 0xffff);
+	status_put16(p + 2, v >> 16);
 }
 
 void
@@ -13,12 +13,100 @@
 /* Card is present */
 #define STATUS_STATE_PRESENT	0x04
 
+/* Retrying after an error (spooling to ram) */
+#define STATUS_STATE_RECOVERING	0x08
+
+/* Out of retries (still spooling, retrying slowly) */
+#define STATUS_STATE_FAILED	0x10
+
+/* Capture isn't being logged (STATUS_CMD_PAUSE) */
+#define STATUS_STATE_PAUSED	0x20
+
+/* ...until the trigger string shows up (STATUS_CMD_TRIGGER) */
+#define STATUS_STATE_ARMED	0x40
+
+/*
+ * I2C register map. A write sets the register pointer (the first
+ * byte) and a read returns up to TWI_BUFSIZE bytes from there, all
+ * taken at once; the pointer goes back to 0 after each read so a
+ * plain read gets the status byte then the capture ring occupancy,
+ * high-water mark (bytes) and longest drain latency (ms) as before.
+ * Numbers are little endian; strings are NUL padded.
+ */
+#define STATUS_MAP_VERSION	2
+
+#define STATUS_REG_STATUS	0x00	/* 1, STATUS_STATE_* */
+#define STATUS_REG_RING		0x01	/* 2 */
+#define STATUS_REG_HWM		0x03	/* 2 */
+#define STATUS_REG_DRAIN	0x05	/* 2 */
+#define STATUS_REG_VERSION	0x07	/* 1, STATUS_MAP_VERSION */
+#define STATUS_REG_CAPTURED	0x08	/* 4, bytes received since boot */
+#define STATUS_REG_WRITTEN	0x0c	/* 4, bytes logged since boot */
+#define STATUS_REG_LOST		0x10	/* 4, bytes lost (ring full) */
+#define STATUS_REG_OVERRUNS	0x14	/* 2, capture USART DOR */
+#define STATUS_REG_FRAMING	0x16	/* 2, FE */
+#define STATUS_REG_PARITY	0x18	/* 2, UPE */
+#define STATUS_REG_SYNCAGE	0x1a	/* 4, ms since the log was synced */
+#define STATUS_REG_SDMAX	0x1e	/* 4, longest card write (us) */
+#define STATUS_REG_SIZE		0x22	/* 4, current log size */
+#define STATUS_REG_FREEKB	0x26	/* 4, free space (KB) */
+#define STATUS_REG_FIRMWARE	0x2a	/* 8, firmware version */
+#define STATUS_REG_NAME		0x32	/* 13, current log name */
+#define STATUS_REG_CMDDONE	0x3f	/* 2, host commands run */
+#define STATUS_REG_CMDDROP	0x41	/* 2, ...dropped (bad or queue full) */
+#define STATUS_MAP_LEN		0x43
+
+#define STATUS_FIRMWARE_LEN	(STATUS_REG_NAME - STATUS_REG_FIRMWARE)
+#define STATUS_NAME_LEN		(STATUS_REG_CMDDONE - STATUS_REG_NAME)
+
+/*
+ * Host commands: a write starting with one of these is queued and
+ * the capture loop runs it once what was received before it has
+ * been logged (so a sync covers everything the host has sent). They
+ * wait while there's no log open. The rest of the write (up to
+ * STATUS_CMDMAX bytes) is the argument.
+ */
+#define STATUS_CMD_SYNC		0x80	/* sync the log */
+#define STATUS_CMD_ROTATE	0x81	/* start a new log */
+#define STATUS_CMD_MARK		0x82	/* write the argument to the log */
+#define STATUS_CMD_TRIGGER	0x83	/* pause until the argument is seen */
+#define STATUS_CMD_PAUSE	0x84	/* stop logging (capture is dropped) */
+#define STATUS_CMD_RESUME	0x85	/* start again, clears the trigger */
+#define STATUS_CMD_LAST		STATUS_CMD_RESUME
+
+#define STATUS_CMDMAX		31	/* TWI_BUFSIZE less the command */
+#define STATUS_CMDQ		4	/* queued (a power of two) */
+
+struct status_cmd {
+	u_long pos;			/* capture received before it */
+	uint8_t cmd;
+	uint8_t len;
+	uint8_t arg[STATUS_CMDMAX];
+};
+
+/* Sync age and free space when there's no log or it isn't known */
+#define STATUS_NONE		0xffffffffUL
+
+/* Refreshed by status_poll() for the TWI interrupt handler */
+struct status_log {
+	u_long captured;
+	u_long written;
+	u_long size;
+	u_long lastsync;		/* msec */
+	char name[STATUS_NAME_LEN];	/* "" when there's no log open */
+};
+
 #define STATUS_ERROR(s)		ISSET((s), STATUS_STATE_ERROR)
 #define STATUS_DIRTY(s)		ISSET((s), STATUS_STATE_DIRTY)
 #define STATUS_PRESENT(s)	ISSET((s), STATUS_STATE_PRESENT)
+#define STATUS_RECOVERING(s)	ISSET((s), STATUS_STATE_RECOVERING)
+#define STATUS_FAILED(s)	ISSET((s), STATUS_STATE_FAILED)
 
 extern uint8_t status;
 
+extern void status_cmddone(void);
+extern boolean status_getcmd(struct status_cmd *);
 extern void status_init(void);
+extern void status_poll(void);
 extern void status_set(boolean, uint8_t);
 #endif
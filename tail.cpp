@@ -0,0 +1,73 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * Capture tail
+ *
+ * drain() copies each chunk it takes from the capture ring into a
+ * small ring here so "tail" can show what's arriving without reading
+ * the card. There's one reader; if it falls more than TAIL_SIZE
+ * behind it skips ahead and counts what it missed. Everything runs
+ * in the main line so the RX interrupt and SD writes don't notice.
+ */
+
+#if __has_include("local.h")
+#include "local.h"
+#endif
+
+#include "sdlogger.h"
+
+#include "tail.h"
+
+#if (TAIL_SIZE & (TAIL_SIZE - 1)) != 0
+#error "TAIL_SIZE must be a power of two"
+#endif
+
+/* Locals */
+static uint8_t buf[TAIL_SIZE];
+static u_long head;			/* bytes ever put */
+static u_long pos;			/* the reader's next byte */
+static u_long dropped;			/* skipped by the reader */
+
+/* Bytes skipped since the last reset */
+u_long
+tail_dropped(boolean reset)
+{
+	u_long n;
+
+	n = dropped;
+	if (reset)
+		dropped = 0;
+	return (n);
+}
+
+/* Next byte for the reader or -1 if it's caught up */
+int
+tail_get(void)
+{
+	if (head - pos > TAIL_SIZE) {
+		dropped += head - pos - TAIL_SIZE;
+		pos = head - TAIL_SIZE;
+	}
+	if (pos == head)
+		return (-1);
+	return (buf[pos++ & (TAIL_SIZE - 1)]);
+}
+
+void
+tail_put(const uint8_t *bp, uint8_t n)
+{
+	while (n-- > 0)
+		buf[head++ & (TAIL_SIZE - 1)] = *bp++;
+}
+
+/* Start reading up to back bytes before the newest */
+void
+tail_start(uint16_t back)
+{
+	if (back > TAIL_SIZE)
+		back = TAIL_SIZE;
+	if (back > head)
+		back = head;
+	pos = head - back;
+	dropped = 0;
+}
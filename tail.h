@@ -0,0 +1,14 @@
+/* @(#) $Id$ (XSE) */
+
+#ifndef _tail_h_
+#define _tail_h_
+/* Recent capture data kept for "tail" (a power of two) */
+#ifndef TAIL_SIZE
+#define TAIL_SIZE	256
+#endif
+
+extern u_long tail_dropped(boolean);
+extern int tail_get(void);
+extern void tail_put(const uint8_t *, uint8_t);
+extern void tail_start(uint16_t);
+#endif
@@ -0,0 +1,120 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * Event trace
+ *
+ * A ring of TRACE_SIZE events (micros(), an id and a 16 bit
+ * argument) that trace() adds to from interrupt handlers and the
+ * main line alike. The first capture RX error arms a trigger and the
+ * trace freezes TRACE_POST events later so the run up to an overrun
+ * survives until someone looks; "trace clear" starts it again.
+ *
+ * "trace" dumps it oldest first as hex, one event per line; feed the
+ * console output to scripts/tracedecode for a timeline.
+ */
+
+#if __has_include("local.h")
+#include "local.h"
+#endif
+
+#include "sdlogger.h"
+
+#include "serial.h"
+#include "sstrings.h"
+#include "stats.h"
+#include "trace.h"
+
+#if (TRACE_SIZE & (TRACE_SIZE - 1)) != 0 || TRACE_SIZE > 256
+#error "TRACE_SIZE must be a power of two no larger than 256"
+#endif
+
+struct trace_event {
+	u_long us;
+	uint8_t id;
+	uint16_t arg;
+};
+
+/* Locals */
+static struct trace_event events[TRACE_SIZE];
+static uint8_t head;			/* next to write */
+static uint16_t count;			/* valid events */
+static uint8_t post;			/* events until frozen (0 is unarmed) */
+static boolean frozen;
+static uint16_t dropped;		/* while frozen or dumping */
+
+/* Record an event; safe from interrupt handlers */
+void
+trace(uint8_t id, uint16_t arg)
+{
+	uint8_t s;
+	u_long us;
+	struct trace_event *ep;
+
+	us = micros();
+	s = SREG;
+	cli();
+	if (frozen) {
+		if (dropped < 0xffff)
+			++dropped;
+		SREG = s;
+		return;
+	}
+	ep = &events[head];
+	ep->us = us;
+	ep->id = id;
+	ep->arg = arg;
+	head = (head + 1) & (TRACE_SIZE - 1);
+	if (count < TRACE_SIZE)
+		++count;
+
+	/* Trigger on the first RX error */
+	if (id == TRACE_RXERR && post == 0)
+		post = TRACE_POST + 1;
+	if (post > 0 && --post == 0)
+		frozen = 1;
+	SREG = s;
+}
+
+void
+trace_cmd(char *s)
+{
+	uint8_t i, was;
+	uint16_t n;
+	struct trace_event *ep;
+
+	while (isblank(*s))
+		++s;
+	if (strcmp_P(s, PSTR("clear")) == 0) {
+		cli();
+		head = 0;
+		count = 0;
+		post = 0;
+		frozen = 0;
+		dropped = 0;
+		sei();
+		stats_traceclear();
+		return;
+	}
+	if (*s != '\0') {
+		serial_putstr(FV(msg_errmsg));
+		return;
+	}
+
+	/* Hold it still while it's printed (events are dropped) */
+	cli();
+	was = frozen;
+	frozen = 1;
+	sei();
+	PRINTF("# trace %u events, %u dropped%S\n", count, dropped,
+	    (was ? PSTR(", frozen") : PSTR("")));
+	n = count;
+	i = (head - n) & (TRACE_SIZE - 1);
+	while (n-- > 0) {
+		ep = &events[i];
+		PRINTF("%08lx %02x %04x\n", ep->us, ep->id, ep->arg);
+		i = (i + 1) & (TRACE_SIZE - 1);
+	}
+	cli();
+	frozen = was;
+	sei();
+}
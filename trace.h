@@ -0,0 +1,29 @@
+/* @(#) $Id$ (XSE) */
+
+#ifndef _trace_h_
+#define _trace_h_
+/* Events (scripts/tracedecode.cpp knows these too) */
+#define TRACE_RXERR	1		/* capture RX error bits */
+#define TRACE_HWM	2		/* capture ring crossed a level */
+#define TRACE_SYNC	3		/* sync started, ring occupancy */
+#define TRACE_SYNCDONE	4		/* sync done, ring occupancy */
+#define TRACE_BUSY	5		/* slow card op: op << 14 | ms */
+#define TRACE_TWIM	6		/* master done: addr << 8 | state */
+#define TRACE_TWIS	7		/* slave received, byte count */
+#define TRACE_CD	8		/* card detect, present */
+#define TRACE_CMD	9		/* command, first two chars */
+
+/* Events kept (a power of two) */
+#ifndef TRACE_SIZE
+#define TRACE_SIZE	128
+#endif
+
+/* Events recorded after an RX error before the trace freezes */
+#define TRACE_POST	(TRACE_SIZE / 8)
+
+/* sdlat ops slower than this are traced (us) */
+#define TRACE_BUSYUS	5000UL
+
+extern void trace(uint8_t, uint16_t);
+extern void trace_cmd(char *);
+#endif
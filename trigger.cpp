@@ -0,0 +1,86 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * Capture trigger
+ *
+ * While capture is paused with a trigger set, drain() runs what it
+ * takes from the RX ring past trigger_scan() and logging resumes
+ * with the trigger string once it shows up. The search is KMP so a
+ * match split between chunks (or overlapping a false start) isn't
+ * missed and each byte is looked at once.
+ */
+
+#if __has_include("local.h")
+#include "local.h"
+#endif
+
+#include "sdlogger.h"
+
+#include "trigger.h"
+
+/* Locals */
+static uint8_t pat[TRIGGER_MAX];
+static uint8_t patlen;
+static boolean armed;
+static uint8_t fail[TRIGGER_MAX];	/* longest proper prefix-suffix */
+static uint8_t matched;			/* of pat so far */
+
+boolean
+trigger_armed(void)
+{
+	return (armed);
+}
+
+/* Copy the last trigger to buf (TRIGGER_MAX), returns its length */
+uint8_t
+trigger_get(uint8_t *buf)
+{
+	memcpy(buf, pat, patlen);
+	return (patlen);
+}
+
+/*
+ * Look for the trigger in n bytes of capture, returns the index of
+ * the byte after it (and disarms) or -1 if it hasn't shown up yet.
+ */
+int16_t
+trigger_scan(const uint8_t *buf, uint8_t n)
+{
+	uint8_t i;
+
+	if (!armed)
+		return (-1);
+	for (i = 0; i < n; ++i) {
+		while (matched > 0 && buf[i] != pat[matched])
+			matched = fail[matched - 1];
+		if (buf[i] == pat[matched] && ++matched == patlen) {
+			armed = 0;
+			return (i + 1);
+		}
+	}
+	return (-1);
+}
+
+/* Arm with n bytes of buf (0 disarms) */
+void
+trigger_set(const uint8_t *buf, uint8_t n)
+{
+	uint8_t i, k;
+
+	if (n > sizeof(pat))
+		n = sizeof(pat);
+	memcpy(pat, buf, n);
+	patlen = n;
+	armed = (n > 0);
+	matched = 0;
+
+	fail[0] = 0;
+	k = 0;
+	for (i = 1; i < n; ++i) {
+		while (k > 0 && pat[i] != pat[k])
+			k = fail[k - 1];
+		if (pat[i] == pat[k])
+			++k;
+		fail[i] = k;
+	}
+}
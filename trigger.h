@@ -0,0 +1,12 @@
+/* @(#) $Id$ (XSE) */
+
+#ifndef _trigger_h_
+#define _trigger_h_
+/* Longest trigger string (an I2C command's argument) */
+#define TRIGGER_MAX	31
+
+extern boolean trigger_armed(void);
+extern uint8_t trigger_get(uint8_t *);
+extern int16_t trigger_scan(const uint8_t *, uint8_t);
+extern void trigger_set(const uint8_t *, uint8_t);
+#endif
@@ -0,0 +1,358 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * Interrupt driven TWI (I2C) master/slave
+ *
+ * Master transactions are queued with twi_queue() and run from the
+ * TWI interrupt one after the other; the caller polls the state
+ * (or gets a callback) so nothing waits on the bus. We answer as a
+ * slave at the address given to twi_init(); the request callback
+ * runs in the interrupt handler and supplies the reply with
+ * twi_reply().
+ *
+ * The handler masks TWIE and turns interrupts back on so the capture
+ * RX interrupt isn't held off by a slave callback or the wait for a
+ * stop; TWINT stays set (and the bus held) until a TWCR_* command is
+ * written and twi_ie() unmasks TWIE on the way out.
+ */
+
+#if __has_include("local.h")
+#include "local.h"
+#endif
+
+#include <util/twi.h>
+
+#include "sdlogger.h"
+
+#include "audit.h"
+#include "sched.h"
+#include "trace.h"
+#include "twi.h"
+
+#ifndef TWI_FREQ
+#define TWI_FREQ	100000L
+#endif
+
+/* TWIE is left to twi_ie() */
+#define TWCR_IDLE	(_BV(TWEN) | _BV(TWEA))
+#define TWCR_ACK	(TWCR_IDLE | _BV(TWINT))
+#define TWCR_NACK	(_BV(TWEN) | _BV(TWINT))
+#define TWCR_START	(TWCR_ACK | _BV(TWSTA))
+#define TWCR_STOP	(TWCR_ACK | _BV(TWSTO))
+
+/* Locals */
+static struct twi_xfer *xhead;		/* master queue */
+static struct twi_xfer *xtail;
+static uint8_t xidx;			/* index into wbuf or rbuf */
+static boolean xreading;		/* in the read phase */
+static volatile boolean mactive;	/* master transaction on the bus */
+static volatile boolean sactive;	/* addressed as a slave */
+static volatile uint8_t aticks;		/* sched_ticks when that started */
+static void (*onrequest)(void);
+static void (*onreceive)(const uint8_t *, uint8_t);
+static uint8_t stxbuf[TWI_BUFSIZE];	/* slave reply */
+static uint8_t stxlen;
+static uint8_t stxidx;
+static uint8_t srxbuf[TWI_BUFSIZE];	/* slave received */
+static uint8_t srxlen;
+
+/* Forwards */
+static void twi_abort(void);
+static void twi_finish(uint8_t, boolean);
+static void twi_ie(void);
+static void twi_start(void);
+
+/* Reset the hardware and fail the current transaction */
+static void
+twi_abort(void)
+{
+	uint8_t s;
+
+	s = SREG;
+	cli();
+	TWCR = 0;
+	TWCR = TWCR_IDLE;
+	sactive = 0;
+	if (mactive)
+		twi_finish(TWI_X_ERR, 0);
+	else
+		twi_start();
+	twi_ie();
+	SREG = s;
+}
+
+/* Complete the current master transaction, start the next (TWIE off) */
+static void
+twi_finish(uint8_t state, boolean stop)
+{
+	uint8_t i;
+	struct twi_xfer *xp;
+
+	if (stop) {
+		TWCR = TWCR_STOP;
+		/* The stop takes a bit time at most */
+		for (i = 255; i > 0 && (TWCR & _BV(TWSTO)) != 0; --i)
+			continue;
+	}
+	mactive = 0;
+	xp = xhead;
+	if (xp != NULL) {
+		xhead = xp->next;
+		if (xhead == NULL)
+			xtail = NULL;
+		xp->next = NULL;
+		xp->state = state;
+		trace(TRACE_TWIM, (xp->addr << 8) | state);
+		if (xp->done != NULL)
+			(*xp->done)(xp);
+	}
+	twi_start();
+}
+
+/* Unmask the interrupt without clearing TWINT (ints off) */
+static void
+twi_ie(void)
+{
+	TWCR = (TWCR & ~_BV(TWINT)) | _BV(TWIE);
+}
+
+void
+twi_init(uint8_t addr)
+{
+	/* Internal pullups */
+	digitalWrite(SDA, HIGH);
+	digitalWrite(SCL, HIGH);
+
+	/* Prescaler 1 */
+	TWSR = 0;
+	TWBR = ((F_CPU / TWI_FREQ) - 16) / 2;
+
+	/* Listen as a slave */
+	TWAR = addr << 1;
+	TWCR = TWCR_IDLE | _BV(TWIE);
+}
+
+void
+twi_onreceive(void (*func)(const uint8_t *, uint8_t))
+{
+	onreceive = func;
+}
+
+void
+twi_onrequest(void (*func)(void))
+{
+	onrequest = func;
+}
+
+/* Scheduler task: recover from a hung bus */
+void
+twi_poll(void)
+{
+	if ((mactive || sactive) &&
+	    (uint8_t)(sched_ticks - aticks) > SCHED_TICKS(TWI_TIMEOUT_MS))
+		twi_abort();
+}
+
+/* Add a transaction to the queue, returns 0 if it's already queued */
+boolean
+twi_queue(struct twi_xfer *xp)
+{
+	uint8_t s;
+
+	s = SREG;
+	cli();
+	if (xp->state == TWI_X_QUEUED) {
+		SREG = s;
+		return (0);
+	}
+	xp->next = NULL;
+	xp->state = TWI_X_QUEUED;
+	if (xtail == NULL)
+		xhead = xp;
+	else
+		xtail->next = xp;
+	xtail = xp;
+	twi_start();
+	twi_ie();
+	SREG = s;
+	return (1);
+}
+
+/* Called from the request callback to set the slave reply */
+void
+twi_reply(const uint8_t *buf, uint8_t len)
+{
+	if (len > sizeof(stxbuf))
+		len = sizeof(stxbuf);
+	memcpy(stxbuf, buf, len);
+	stxlen = len;
+}
+
+/* Start the next master transaction if the bus is ours (TWIE off) */
+static void
+twi_start(void)
+{
+	if (xhead != NULL && !mactive && !sactive) {
+		mactive = 1;
+		aticks = sched_ticks;
+		TWCR = TWCR_START;
+	}
+}
+
+/*
+ * Queue a transaction and wait for it; only for the console and
+ * boot time. Bounded since twi_poll() aborts a hung transaction.
+ */
+boolean
+twi_sync(struct twi_xfer *xp)
+{
+	if (!twi_queue(xp))
+		return (0);
+	while (!TWI_X_DONE(xp))
+		twi_poll();
+	return (xp->state == TWI_X_OK);
+}
+
+ISR(TWI_vect)
+{
+	struct twi_xfer *xp;
+	AUDIT_ENTER();
+
+	TWCR = TWCR & ~(_BV(TWIE) | _BV(TWINT));
+	AUDIT_SEI();
+
+	xp = xhead;
+	switch (TW_STATUS) {
+
+	/* Master */
+	case TW_START:
+		if (xp == NULL) {
+			/* Nothing to do after all */
+			TWCR = TWCR_STOP;
+			mactive = 0;
+			break;
+		}
+		xreading = (xp->wlen == 0);
+		/* FALLTHROUGH */
+
+	case TW_REP_START:
+		xidx = 0;
+		TWDR = (xp->addr << 1) | (xreading ? TW_READ : TW_WRITE);
+		TWCR = TWCR_ACK;
+		break;
+
+	case TW_MT_SLA_ACK:
+	case TW_MT_DATA_ACK:
+		if (xidx < xp->wlen) {
+			TWDR = xp->wbuf[xidx++];
+			TWCR = TWCR_ACK;
+		} else if (xp->rlen > 0) {
+			xreading = 1;
+			TWCR = TWCR_START;
+		} else
+			twi_finish(TWI_X_OK, 1);
+		break;
+
+	case TW_MT_SLA_NACK:
+	case TW_MT_DATA_NACK:
+	case TW_MR_SLA_NACK:
+		twi_finish(TWI_X_ERR, 1);
+		break;
+
+	case TW_MT_ARB_LOST:
+		/* Try again when the bus is free */
+		xreading = (xp->wlen == 0);
+		TWCR = TWCR_START;
+		break;
+
+	case TW_MR_DATA_ACK:
+		xp->rbuf[xidx++] = TWDR;
+		/* FALLTHROUGH */
+
+	case TW_MR_SLA_ACK:
+		/* Nack the last byte */
+		TWCR = (xidx + 1 < xp->rlen) ? TWCR_ACK : TWCR_NACK;
+		break;
+
+	case TW_MR_DATA_NACK:
+		xp->rbuf[xidx++] = TWDR;
+		twi_finish(TWI_X_OK, 1);
+		break;
+
+	/* Slave receiver */
+	case TW_SR_ARB_LOST_SLA_ACK:
+	case TW_SR_ARB_LOST_GCALL_ACK:
+		/* Our start lost; twi_start() retries when we're done */
+		mactive = 0;
+		/* FALLTHROUGH */
+
+	case TW_SR_SLA_ACK:
+	case TW_SR_GCALL_ACK:
+		sactive = 1;
+		aticks = sched_ticks;
+		srxlen = 0;
+		TWCR = TWCR_ACK;
+		break;
+
+	case TW_SR_DATA_ACK:
+	case TW_SR_GCALL_DATA_ACK:
+		if (srxlen < sizeof(srxbuf))
+			srxbuf[srxlen++] = TWDR;
+		/* Nack once we're full */
+		TWCR = (srxlen < sizeof(srxbuf)) ? TWCR_ACK : TWCR_NACK;
+		break;
+
+	case TW_SR_STOP:
+	case TW_SR_DATA_NACK:
+	case TW_SR_GCALL_DATA_NACK:
+		TWCR = TWCR_ACK;
+		sactive = 0;
+		trace(TRACE_TWIS, srxlen);
+		if (onreceive != NULL)
+			(*onreceive)(srxbuf, srxlen);
+		twi_start();
+		break;
+
+	/* Slave transmitter */
+	case TW_ST_ARB_LOST_SLA_ACK:
+		mactive = 0;
+		/* FALLTHROUGH */
+
+	case TW_ST_SLA_ACK:
+		sactive = 1;
+		aticks = sched_ticks;
+		stxidx = 0;
+		stxlen = 0;
+		if (onrequest != NULL)
+			(*onrequest)();
+		/* FALLTHROUGH */
+
+	case TW_ST_DATA_ACK:
+		TWDR = (stxidx < stxlen) ? stxbuf[stxidx++] : 0xff;
+		/* Expect a nack after the last byte */
+		TWCR = (stxidx < stxlen) ? TWCR_ACK : TWCR_NACK;
+		break;
+
+	case TW_ST_DATA_NACK:
+	case TW_ST_LAST_DATA:
+		TWCR = TWCR_ACK;
+		sactive = 0;
+		twi_start();
+		break;
+
+	case TW_BUS_ERROR:
+		/* Illegal start or stop; release the bus */
+		TWCR = TWCR_STOP;
+		sactive = 0;
+		if (mactive)
+			twi_finish(TWI_X_ERR, 0);
+		break;
+
+	case TW_NO_INFO:
+	default:
+		break;
+	}
+	cli();
+	twi_ie();
+	AUDIT_EXIT(AUDIT_TWI);
+}
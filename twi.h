@@ -0,0 +1,44 @@
+/* @(#) $Id$ (XSE) */
+
+#ifndef _twi_h_
+#define _twi_h_
+/* Slave buffer sizes */
+#ifndef TWI_BUFSIZE
+#define TWI_BUFSIZE	32
+#endif
+
+/* Give up on a master transaction after this long */
+#define TWI_TIMEOUT_MS	25
+
+/* Transaction states */
+#define TWI_X_IDLE	0		/* never queued */
+#define TWI_X_QUEUED	1		/* waiting or in progress */
+#define TWI_X_OK	2		/* finished */
+#define TWI_X_ERR	3		/* no ack, bus error or timeout */
+
+#define TWI_X_DONE(xp)	((xp)->state >= TWI_X_OK)
+
+/*
+ * Master transaction: write wlen bytes from wbuf, then (repeated
+ * start) read rlen bytes into rbuf. Either length may be zero.
+ * done (if not NULL) is called from the interrupt handler.
+ */
+struct twi_xfer {
+	struct twi_xfer *next;
+	uint8_t addr;
+	uint8_t wlen;
+	uint8_t rlen;
+	const uint8_t *wbuf;
+	uint8_t *rbuf;
+	void (*done)(struct twi_xfer *);
+	volatile uint8_t state;
+};
+
+extern void twi_init(uint8_t);
+extern void twi_onreceive(void (*)(const uint8_t *, uint8_t));
+extern void twi_onrequest(void (*)(void));
+extern void twi_poll(void);
+extern boolean twi_queue(struct twi_xfer *);
+extern void twi_reply(const uint8_t *, uint8_t);
+extern boolean twi_sync(struct twi_xfer *);
+#endif
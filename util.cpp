@@ -18,6 +18,13 @@
 uint8_t *heapptr, *stackptr;
 uint8_t boot_mcusr;
 
+/* Linker and malloc() symbols */
+extern uint8_t _end;
+extern char *__brkval;
+
+/* Forwards */
+void stack_paint(void) __attribute__((naked, used, section(".init1")));
+
 /*
  * This function places the current value of the heap and stack
  * pointers in the variables. You can call it from any place in
@@ -28,20 +35,14 @@ uint8_t boot_mcusr;
  * grows upwards. SP should always be larger than HP or you'll be
  * in big trouble! The smaller the gap, the more careful you need
  * to be. Julian Gall 6-Feb-2009.
+ *
+ * The heap pointer comes from malloc()'s break rather than a
+ * malloc()/free() pair which would scribble on the stack paint.
  */
 void
 check_mem(void)
 {
-	// use stackptr temporarily
-	stackptr = (uint8_t *)malloc(4);
-
-	// save value of heap pointer
-	heapptr = stackptr;
-
-	// free up the memory again (sets stackptr to 0)
-	free(stackptr);
-
-	// save value of stack pointer
+	heapptr = (__brkval != NULL) ? (uint8_t *)__brkval : &_end;
 	stackptr = (uint8_t *)(SP);
 }
 
@@ -141,6 +142,44 @@ reset(void)
 		continue;
 }
 
+/*
+ * Deepest the stack has been (bytes) and the free RAM it has never
+ * touched (between the heap and that)
+ */
+uint16_t
+stack_max(uint16_t *unusedp)
+{
+	uint8_t *p;
+
+	check_mem();
+	for (p = heapptr; p < (uint8_t *)SP && *p == STACK_CANARY; ++p)
+		continue;
+	*unusedp = p - heapptr;
+	return ((uint8_t *)RAMEND + 1 - p);
+}
+
+/*
+ * Fill everything above .bss with STACK_CANARY before the C runtime
+ * is set up (.init1). There's no stack yet and r1 isn't zero so it
+ * has to be assembler.
+ */
+void
+stack_paint(void)
+{
+	__asm volatile (
+	    "	ldi r30, lo8(_end)\n"
+	    "	ldi r31, hi8(_end)\n"
+	    "	ldi r24, %0\n"
+	    "	ldi r25, hi8(__stack)\n"
+	    "	rjmp 2f\n"
+	    "1:	st Z+, r24\n"
+	    "2:	cpi r30, lo8(__stack)\n"
+	    "	cpc r31, r25\n"
+	    "	brlo 1b\n"
+	    "	breq 1b\n"
+	    : : "i" (STACK_CANARY));
+}
+
 /* u_long to string with arbitrary base */
 static const char digits[37] PROGMEM = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 #define MAX_BASE ((int8_t)(sizeof(digits) - 1))
@@ -23,6 +23,14 @@
 #define MHZ_STR ""
 #endif
 
+/* Fills the free RAM at boot; the stack high water is where it stops */
+#define STACK_CANARY	0xc5
+
+/* Keep this much spare when suggesting a bigger UART0_SIZE */
+#ifndef STACK_MARGIN
+#define STACK_MARGIN	256
+#endif
+
 extern unsigned int __data_start;
 extern unsigned int __data_end;
 extern unsigned int __bss_start;
@@ -40,6 +48,7 @@ extern void prhex(const __FlashStringHelper *, const u_char *, int);
 extern void prts(void);
 extern void prmcusr(char *, int8_t);
 extern void reset(void);
+extern uint16_t stack_max(uint16_t *);
 extern int8_t ui2str(uint16_t, char *, int8_t, int8_t);
 
 extern uint8_t *heapptr, *stackptr;
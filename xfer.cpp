@@ -0,0 +1,314 @@
+/*
+ * @(#) $Id$ (XSE)
+ *
+ * Binary file transfer on the console
+ *
+ * "xfer ls" and "xfer get" run as console jobs that send CRC framed
+ * binary (see xfer.h) instead of text so a host (scripts/xfer.cpp)
+ * can copy logs off without pulling the card. get reads a sector at
+ * a time into the shared job buffer (after the first read lines the
+ * file position up with the sectors) and sends it in XFER_FRAMESIZE
+ * frames for up to XFER_SLICEMS each time cmd_poll() runs; console
+ * output that has to wait keeps draining capture (serial_onyield())
+ * and the job waits like the rest of the console when the capture
+ * ring backs up. There are no retransmissions: the host checks each
+ * frame and asks again from the last good offset.
+ *
+ * "xfer speed N" switches the console speed after the reply goes
+ * out; xfer_poll() puts it back to UART1_BAUD if there hasn't been
+ * an xfer command for XFER_IDLEMS.
+ */
+
+#if __has_include("local.h")
+#include "local.h"
+#endif
+
+#include <util/crc16.h>
+
+#include "sdlogger.h"
+
+#include "cmd.h"
+#include "serial.h"
+#include "sstrings.h"
+#include "status.h"
+#include "xfer.h"
+
+#define XS_NONE		0
+#define XS_LS		1
+#define XS_GET		2
+
+/* Locals */
+static uint8_t state;
+static SdFile xf;			/* the directory or the file */
+static u_long pos;			/* file offset of the next byte */
+static u_long left;			/* bytes still to send */
+static uint16_t blen;			/* in cmd_jobbuf[] */
+static uint16_t bpos;
+static u_long lastms;			/* the last xfer command or slice */
+static boolean fast;			/* not at UART1_BAUD */
+
+/* Forwards */
+static void xfer_frame(uint8_t, u_long, const uint8_t *, uint16_t);
+static boolean xfer_get(char *);
+static boolean xfer_getslice(void);
+static boolean xfer_lsslice(void);
+static void xfer_speed(char *);
+
+/* Returns true if a job was started (cmd_job() runs xfer_slice()) */
+boolean
+xfer_cmd(char *s)
+{
+	lastms = millis();
+	while (isblank(*s))
+		++s;
+	if (strcmp_P(s, PSTR("ls")) == 0) {
+		xf = curdir;
+		xf.rewind();
+		state = XS_LS;
+		serial_raw(1);
+		return (1);
+	}
+	if (strncmp_P(s, PSTR("get "), 4) == 0)
+		return (xfer_get(s + 4));
+	if (strncmp_P(s, PSTR("speed "), 6) == 0) {
+		xfer_speed(s + 6);
+		return (0);
+	}
+	serial_putstr(FV(msg_errmsg));
+	return (0);
+}
+
+/* Called by cmd_job() when the job is done or interrupted */
+void
+xfer_end(void)
+{
+	serial_raw(0);
+	if (state == XS_GET)
+		xf.close();
+	state = XS_NONE;
+	lastms = millis();
+}
+
+/* Send a frame (n bytes of data) */
+static void
+xfer_frame(uint8_t type, u_long offset, const uint8_t *buf, uint16_t n)
+{
+	uint8_t i, hdr[1 + XFER_HDRSIZE], tr[2];
+	uint16_t crc, j;
+
+	hdr[0] = XFER_SYNC;
+	hdr[1] = type;
+	hdr[2] = offset;
+	hdr[3] = offset >> 8;
+	hdr[4] = offset >> 16;
+	hdr[5] = offset >> 24;
+	hdr[6] = n;
+	hdr[7] = n >> 8;
+	crc = 0;
+	for (i = 1; i < sizeof(hdr); ++i)
+		crc = _crc_xmodem_update(crc, hdr[i]);
+	for (j = 0; j < n; ++j)
+		crc = _crc_xmodem_update(crc, buf[j]);
+	tr[0] = crc >> 8;
+	tr[1] = crc;
+
+	serial_putbuf(hdr, sizeof(hdr));
+	serial_putbuf(buf, n);
+	serial_putbuf(tr, sizeof(tr));
+}
+
+/* "xfer get name [offset [length]]" */
+static boolean
+xfer_get(char *s)
+{
+	char *name, *ep;
+	u_long size, length;
+
+	while (isblank(*s))
+		++s;
+	name = s;
+	while (*s != '\0' && !isblank(*s))
+		++s;
+	if (*s != '\0')
+		*s++ = '\0';
+
+	pos = 0;
+	length = ~0UL;
+	if (*s != '\0') {
+		pos = strtoul(s, &ep, 10);
+		if (ep == s || (*ep != '\0' && !isblank(*ep))) {
+			serial_putstr(FV(msg_badvalue));
+			return (0);
+		}
+		s = ep;
+		while (isblank(*s))
+			++s;
+		if (*s != '\0') {
+			length = strtoul(s, &ep, 10);
+			if (ep == s || *ep != '\0') {
+				serial_putstr(FV(msg_badvalue));
+				return (0);
+			}
+		}
+	}
+	if (*name == '\0') {
+		serial_putstr(FV(msg_errmsg));
+		return (0);
+	}
+
+	xf = SdFile();
+	if (!xf.open(&curdir, name, O_READ)) {
+		PRINTF("Can't open %s\n", name);
+		return (0);
+	}
+	if (xf.isDir() || xf.isSubDir()) {
+		SERIAL_PUTSTR("Can't get directory\n");
+		xf.close();
+		return (0);
+	}
+
+	/* Past the end just gets the end frame */
+	size = xf.fileSize();
+	if (pos > size)
+		pos = size;
+	left = size - pos;
+	if (length < left)
+		left = length;
+	if (!xf.seekSet(pos)) {
+		PRINTF("Can't seek %s\n", name);
+		xf.close();
+		return (0);
+	}
+	blen = 0;
+	bpos = 0;
+	state = XS_GET;
+	serial_raw(1);
+	return (1);
+}
+
+/* Send the next frame of the file, returns 0 when it's done */
+static boolean
+xfer_getslice(void)
+{
+	uint16_t n;
+	int16_t r;
+
+	if (left == 0) {
+		xfer_frame(XFER_END, pos, NULL, 0);
+		return (0);
+	}
+	if (bpos >= blen) {
+		/* Up to the next sector boundary */
+		n = CMD_JOBBUFSIZE - (uint16_t)(pos % CMD_JOBBUFSIZE);
+		if (n > left)
+			n = left;
+		r = xf.read(cmd_jobbuf, n);
+		if (r < 0) {
+			xfer_frame(XFER_ERR, pos, NULL, 0);
+			return (0);
+		}
+		if (r == 0) {
+			/* Shorter than it said */
+			xfer_frame(XFER_END, pos, NULL, 0);
+			return (0);
+		}
+		blen = r;
+		bpos = 0;
+	}
+	n = blen - bpos;
+	if (n > XFER_FRAMESIZE)
+		n = XFER_FRAMESIZE;
+	xfer_frame(XFER_DATA, pos, cmd_jobbuf + bpos, n);
+	bpos += n;
+	pos += n;
+	left -= n;
+	return (1);
+}
+
+/* Send the next file name and size, returns 0 when it's done */
+static boolean
+xfer_lsslice(void)
+{
+	uint8_t i, n;
+	char name[13];
+	dir_t d;
+
+	for (;;) {
+		if (xf.readDir(d) <= 0 || d.name[0] == DIR_NAME_FREE) {
+			xfer_frame(XFER_END, 0, NULL, 0);
+			return (0);
+		}
+		if (d.name[0] != DIR_NAME_DELETED && d.name[0] != '.' &&
+		    DIR_IS_FILE(&d))
+			break;
+	}
+
+	/* 8.3 name like printDirName() */
+	n = 0;
+	for (i = 0; i < 11; ++i) {
+		if (d.name[i] == ' ')
+			continue;
+		if (i == 8)
+			name[n++] = '.';
+		name[n++] = d.name[i];
+	}
+	xfer_frame(XFER_NAME, d.fileSize, (const uint8_t *)name, n);
+	return (1);
+}
+
+/* Scheduler task: put the console speed back when we're done */
+void
+xfer_poll(void)
+{
+	if (!fast || state != XS_NONE ||
+	    MILLIS_SUB(millis(), lastms) < XFER_IDLEMS)
+		return;
+	serial_setspeed(UART1_BAUD);
+	fast = 0;
+	DPRINTF("xfer: console back to %lu\n", (u_long)UART1_BAUD);
+}
+
+/* Frames for up to XFER_SLICEMS, returns 0 when the job is done */
+boolean
+xfer_slice(void)
+{
+	boolean more;
+	u_long t0;
+
+	t0 = millis();
+	lastms = t0;
+	if (!STATUS_PRESENT(status)) {
+		xfer_frame(XFER_ERR, pos, NULL, 0);
+		return (0);
+	}
+	do {
+		if (state == XS_LS)
+			more = xfer_lsslice();
+		else
+			more = xfer_getslice();
+	} while (more && MILLIS_SUB(millis(), t0) < XFER_SLICEMS);
+	return (more);
+}
+
+/* "xfer speed N", 0 is the default; the prompt is at the new speed */
+static void
+xfer_speed(char *s)
+{
+	char *ep;
+	u_long speed;
+
+	speed = strtoul(s, &ep, 10);
+	if (ep == s || *ep != '\0') {
+		serial_putstr(FV(msg_badvalue));
+		return;
+	}
+	if (speed == 0)
+		speed = UART1_BAUD;
+	if (!serial_speed(speed)) {
+		serial_putstr(FV(msg_badvalue));
+		return;
+	}
+	SERIAL_PUTSTR("ok\n");
+	serial_setspeed(speed);
+	fast = (speed != UART1_BAUD);
+}
@@ -0,0 +1,25 @@
+/* @(#) $Id$ (XSE) */
+
+#ifndef _xfer_h_
+#define _xfer_h_
+/*
+ * Frames are XFER_SYNC, type, offset (4 bytes), length (2 bytes),
+ * the data and a CRC-16/XMODEM of type through data (MSB first);
+ * the numbers are little endian. Keep in sync with scripts/xfer.cpp.
+ */
+#define XFER_SYNC	0xa5
+#define XFER_DATA	'D'		/* file data at offset */
+#define XFER_NAME	'L'		/* a file name, offset is its size */
+#define XFER_END	'E'		/* offset is where it ended */
+#define XFER_ERR	'!'		/* read error at offset */
+
+#define XFER_HDRSIZE	7		/* type through length */
+#define XFER_FRAMESIZE	128		/* most data in a frame */
+#define XFER_SLICEMS	20		/* sending frames each slice */
+#define XFER_IDLEMS	10000L		/* before a raised speed reverts */
+
+extern boolean xfer_cmd(char *);
+extern void xfer_end(void);
+extern void xfer_poll(void);
+extern boolean xfer_slice(void);
+#endif